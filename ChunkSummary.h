@@ -0,0 +1,136 @@
+//
+// Chunk summaries for the recording's index, built by MyPinTool when it
+// drains a buffer and tested by the offline query tool to skip chunks
+// that cannot match.
+//
+// The pages a chunk reads or writes and the routines it enters or leaves
+// go into small Bloom filters with two probes per key; the address range
+// and the stamps bracket what the filters cannot say. Tests err on the
+// side of "may match", so a skipped chunk never holds a match.
+//
+
+#ifndef CHUNK_SUMMARY_H
+#define CHUNK_SUMMARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "RecordFormat.h"
+
+#define SUMMARY_EA_BITS (SUMMARY_EA_WORDS * 64)
+#define SUMMARY_RTN_BITS (SUMMARY_RTN_WORDS * 64)
+
+// Pages of an access range past which the filter is not worth probing
+#define SUMMARY_MAX_PROBED_PAGES 64
+
+/* ===================================================================== */
+// Filters
+/* ===================================================================== */
+
+// The two bits of key in a filter of 'bits' bits, a power of two
+static inline void SummaryProbes(uint64_t key, uint32_t bits, uint32_t * a, uint32_t * b)
+{
+    uint64_t h = key * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+    *a = (uint32_t)h & (bits - 1);
+    *b = (uint32_t)(h >> 32) & (bits - 1);
+}
+
+static inline void SummaryFilterAdd(uint64_t * filter, uint32_t bits, uint64_t key)
+{
+    uint32_t a, b;
+    SummaryProbes(key, bits, &a, &b);
+    filter[a / 64] |= 1ull << (a % 64);
+    filter[b / 64] |= 1ull << (b % 64);
+}
+
+static inline bool SummaryFilterHas(const uint64_t * filter, uint32_t bits, uint64_t key)
+{
+    uint32_t a, b;
+    SummaryProbes(key, bits, &a, &b);
+    return (filter[a / 64] >> (a % 64) & 1) && (filter[b / 64] >> (b % 64) & 1);
+}
+
+/* ===================================================================== */
+// Building
+/* ===================================================================== */
+
+// Start the summary of a chunk whose first record runs under stamp
+static inline void SummaryInit(CHUNK_SUMMARY * s, uint64_t stamp)
+{
+    memset(s, 0, sizeof(*s));
+    s->_firstStamp = stamp;
+    s->_lastStamp = stamp;
+    s->_minEa = UINT64_MAX;
+}
+
+static inline void SummaryAdd(CHUNK_SUMMARY * s, const TRACE_RECORD * recs, uint32_t count)
+{
+    for (const TRACE_RECORD * rec = recs; rec < recs + count; rec++)
+    {
+        if (rec->_kind < 32)
+            s->_kinds |= 1u << rec->_kind;
+        switch (rec->_kind)
+        {
+          case REC_READ:
+          case REC_WRITE:
+          {
+            uint64_t last = rec->_ea + (rec->_size ? rec->_size - 1 : 0);
+            if (rec->_ea < s->_minEa)
+                s->_minEa = rec->_ea;
+            if (last > s->_maxEa)
+                s->_maxEa = last;
+            for (uint64_t page = rec->_ea >> SUMMARY_PAGE_SHIFT; page <= last >> SUMMARY_PAGE_SHIFT; page++)
+                SummaryFilterAdd(s->_eaFilter, SUMMARY_EA_BITS, page);
+            break;
+          }
+          case REC_RTN_ENTER:
+          case REC_RTN_EXIT:
+            SummaryFilterAdd(s->_rtnFilter, SUMMARY_RTN_BITS, rec->_ip);
+            break;
+          case REC_STAMP:
+            s->_lastStamp = rec->_value;
+            break;
+          default:
+            break;
+        }
+    }
+}
+
+/* ===================================================================== */
+// Queries
+/* ===================================================================== */
+
+static inline bool SummaryHasKind(const CHUNK_SUMMARY & s, uint32_t kind)
+{
+    return kind < 32 && (s._kinds >> kind & 1);
+}
+
+// Whether the chunk may read or write a byte of [lo, hi]
+static inline bool SummaryMayAccess(const CHUNK_SUMMARY & s, uint64_t lo, uint64_t hi)
+{
+    if (s._minEa > s._maxEa || hi < s._minEa || lo > s._maxEa)
+        return false;
+    if ((hi >> SUMMARY_PAGE_SHIFT) - (lo >> SUMMARY_PAGE_SHIFT) >= SUMMARY_MAX_PROBED_PAGES)
+        return true;
+    for (uint64_t page = lo >> SUMMARY_PAGE_SHIFT; page <= hi >> SUMMARY_PAGE_SHIFT; page++)
+    {
+        if (SummaryFilterHas(s._eaFilter, SUMMARY_EA_BITS, page))
+            return true;
+    }
+    return false;
+}
+
+// Whether the chunk may enter or leave the routine at rtn
+static inline bool SummaryMayHaveRoutine(const CHUNK_SUMMARY & s, uint64_t rtn)
+{
+    return SummaryFilterHas(s._rtnFilter, SUMMARY_RTN_BITS, rtn);
+}
+
+// Whether the chunk may hold events under a stamp in [from, to]
+static inline bool SummaryMayOverlap(const CHUNK_SUMMARY & s, uint64_t from, uint64_t to)
+{
+    return s._lastStamp >= from && s._firstStamp <= to;
+}
+
+#endif
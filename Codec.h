@@ -0,0 +1,426 @@
+//
+// Streaming codec for the records of one chunk, used by MyPinTool when it
+// drains a buffer and by the offline tools to read it back.
+//
+// Every record is predicted from the one before it: the successor table
+// remembers what record followed each "site" (a static instruction, the
+// store a value belongs to, a register at a given place), and the site
+// table remembers the last address or value seen there and its stride.
+// A record that matches both predictions costs nothing and consecutive
+// ones are run-length encoded; otherwise the mispredicted parts are
+// written as zig-zag varint deltas. The state is reset for every chunk,
+// so chunks decode independently.
+//
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "RecordFormat.h"
+
+#define CODEC_TABLE_BITS 12
+#define CODEC_TABLE_SIZE (1 << CODEC_TABLE_BITS)
+
+// Token byte: the record kind in the low bits, or CODEC_RUN followed by a
+// varint count of fully predicted records. Kinds after REC_RTN_EXIT do
+// not fit and set CODEC_EXTENDED, see CodecToken
+#define CODEC_KIND_MASK 0x07
+#define CODEC_RUN 0x07
+#define CODEC_SHAPE_HIT 0x08
+#define CODEC_DATA_HIT 0x10
+#define CODEC_EXTENDED 0x20
+#define CODEC_BAD_KIND 0xffffffffu
+
+// Upper bound of the encoded size of 'count' records
+#define CODEC_MAX_BYTES(count) ((size_t)(count) * 32 + 16)
+
+// What a record looks like apart from its data: _key is the instruction
+// for memory and routine records, the register for REC_REG, the byte
+// offset in the register for REC_VREG and the offset from the store for
+// REC_VALUE
+typedef struct CodecShape
+{
+    uint64_t _key;
+    uint32_t _size;
+    uint32_t _kind;
+} CODEC_SHAPE;
+
+typedef struct CodecSite
+{
+    uint64_t _tag;
+    uint64_t _last;             // address for memory records, else value
+    uint64_t _stride;
+} CODEC_SITE;
+
+typedef struct CodecState
+{
+    CODEC_SHAPE _next[CODEC_TABLE_SIZE];    // by the previous record's site
+    CODEC_SITE _sites[CODEC_TABLE_SIZE];
+    uint64_t _prevSite;
+    uint64_t _lastIp;
+    uint64_t _lastEa;
+    uint64_t _storeIp;
+    uint64_t _storeEa;
+} CODEC_STATE;
+
+/* ===================================================================== */
+// Helpers
+/* ===================================================================== */
+
+static inline uint32_t CodecHash(uint64_t site)
+{
+    return (uint32_t)((site * 0x9E3779B97F4A7C15ull) >> (64 - CODEC_TABLE_BITS));
+}
+
+static inline uint64_t CodecZigZag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t CodecUnZigZag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint8_t * CodecPutVarint(uint8_t * out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *out++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (uint8_t)v;
+    return out;
+}
+
+// Returns 0 if the input ends inside the varint
+static inline const uint8_t * CodecGetVarint(const uint8_t * in, const uint8_t * end, uint64_t * v)
+{
+    uint64_t result = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *in++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *v = result;
+            return in;
+        }
+    }
+    return 0;
+}
+
+static inline bool CodecIsMem(uint32_t kind)
+{
+    return kind == REC_READ || kind == REC_WRITE;
+}
+
+static inline bool CodecHasData(uint32_t kind)
+{
+    return kind == REC_READ || kind == REC_WRITE || kind == REC_VALUE || kind == REC_REG || kind == REC_SYSCALL
+        || kind == REC_STAMP || kind == REC_VREG;
+}
+
+// Register records, whose data belongs to the last instruction seen
+static inline bool CodecIsReg(uint32_t kind)
+{
+    return kind == REC_REG || kind == REC_VREG;
+}
+
+// Kind bits of the token of an event kind, and back. Checkpoint kinds
+// never appear among events and have no token
+static inline uint8_t CodecToken(uint32_t kind)
+{
+    if (kind == REC_SYSCALL)
+        return CODEC_EXTENDED | 0;
+    if (kind == REC_STAMP)
+        return CODEC_EXTENDED | 1;
+    if (kind == REC_VREG)
+        return CODEC_EXTENDED | 2;
+    return (uint8_t)kind;
+}
+
+static inline uint32_t CodecKind(uint8_t token)
+{
+    uint8_t code = token & (CODEC_EXTENDED | CODEC_KIND_MASK);
+    switch (code)
+    {
+      case CODEC_EXTENDED | 0:
+        return REC_SYSCALL;
+      case CODEC_EXTENDED | 1:
+        return REC_STAMP;
+      case CODEC_EXTENDED | 2:
+        return REC_VREG;
+      default:
+        return code <= REC_RTN_EXIT ? code : CODEC_BAD_KIND;
+    }
+}
+
+// Site of a record of the given kind and key, in the current state
+static inline uint64_t CodecSiteOf(const CODEC_STATE * st, uint32_t kind, uint64_t key)
+{
+    uint64_t site = key * 0xff51afd7ed558ccdull + kind;
+    if (kind == REC_VALUE)
+        site ^= st->_storeIp;
+    else if (CodecIsReg(kind))
+        site ^= st->_lastIp;
+    return site;
+}
+
+static inline void CodecReset(CODEC_STATE * st)
+{
+    memset(st, 0, sizeof(*st));
+}
+
+// Bookkeeping shared by encoder and decoder once a record is known
+static inline void CodecUpdate(CODEC_STATE * st, uint64_t site, CODEC_SITE * slot, const CODEC_SHAPE & shape,
+                               uint64_t data, uint64_t ea)
+{
+    if (CodecHasData(shape._kind))
+    {
+        slot->_stride = slot->_tag == site ? data - slot->_last : 0;
+        slot->_tag = site;
+        slot->_last = data;
+    }
+    st->_next[CodecHash(st->_prevSite)] = shape;
+    st->_prevSite = site;
+
+    if (shape._kind != REC_VALUE && !CodecIsReg(shape._kind) && shape._kind != REC_STAMP)
+        st->_lastIp = shape._key;
+    if (CodecIsMem(shape._kind))
+        st->_lastEa = ea;
+    if (shape._kind == REC_WRITE)
+    {
+        st->_storeIp = shape._key;
+        st->_storeEa = ea;
+    }
+}
+
+/* ===================================================================== */
+// Encoder
+/* ===================================================================== */
+
+// Encode 'count' records into out, which must hold CODEC_MAX_BYTES(count).
+// Returns the number of bytes used, or 0 if some record is not one the
+// codec can reproduce exactly; the caller then stores the chunk raw
+static inline size_t CodecEncode(CODEC_STATE * st, const TRACE_RECORD * recs, uint32_t count, uint8_t * out)
+{
+    CodecReset(st);
+    uint8_t * start = out;
+    uint64_t run = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const TRACE_RECORD * rec = &recs[i];
+        CODEC_SHAPE shape;
+        uint64_t data = 0;
+        shape._kind = rec->_kind;
+        shape._size = rec->_size;
+        switch (rec->_kind)
+        {
+          case REC_READ:
+          case REC_WRITE:
+            shape._key = rec->_ip;
+            data = rec->_ea;
+            break;
+          case REC_VALUE:
+            shape._key = rec->_ea - st->_storeEa;
+            data = rec->_value;
+            break;
+          case REC_REG:
+            if (rec->_ea != 0)
+                return 0;
+            shape._key = rec->_size;
+            data = rec->_value;
+            break;
+          case REC_VREG:
+            shape._key = rec->_ea;
+            data = rec->_value;
+            break;
+          case REC_RTN_ENTER:
+          case REC_RTN_EXIT:
+            if (rec->_ea != 0)
+                return 0;
+            shape._key = rec->_ip;
+            break;
+          case REC_SYSCALL:
+            shape._key = rec->_ip;
+            data = rec->_ea;
+            break;
+          case REC_STAMP:
+            if (rec->_ea != 0)
+                return 0;
+            shape._key = 0;
+            data = rec->_value;
+            break;
+          default:
+            return 0;
+        }
+
+        uint64_t site = CodecSiteOf(st, shape._kind, shape._key);
+        CODEC_SITE * slot = &st->_sites[CodecHash(site)];
+        const CODEC_SHAPE & guess = st->_next[CodecHash(st->_prevSite)];
+        bool shapeHit = guess._kind == shape._kind && guess._size == shape._size && guess._key == shape._key;
+        bool dataHit = !CodecHasData(shape._kind) || (slot->_tag == site && slot->_last + slot->_stride == data);
+
+        if (shapeHit && dataHit)
+        {
+            run++;
+        }
+        else
+        {
+            if (run)
+            {
+                *out++ = CODEC_RUN;
+                out = CodecPutVarint(out, run);
+                run = 0;
+            }
+            *out++ = (uint8_t)(CodecToken(shape._kind) | (shapeHit ? CODEC_SHAPE_HIT : 0) | (dataHit ? CODEC_DATA_HIT : 0));
+            if (!shapeHit)
+            {
+                out = CodecPutVarint(out, shape._size);
+                if (CodecIsReg(shape._kind))
+                    out = CodecPutVarint(out, shape._key);
+                else if (shape._kind == REC_VALUE)
+                    out = CodecPutVarint(out, CodecZigZag((int64_t)shape._key));
+                else
+                    out = CodecPutVarint(out, CodecZigZag((int64_t)(shape._key - st->_lastIp)));
+            }
+            if (!dataHit)
+            {
+                uint64_t base = slot->_tag == site ? slot->_last : CodecIsMem(shape._kind) ? st->_lastEa : 0;
+                out = CodecPutVarint(out, CodecZigZag((int64_t)(data - base)));
+            }
+        }
+
+        CodecUpdate(st, site, slot, shape, data, rec->_ea);
+    }
+
+    if (run)
+    {
+        *out++ = CODEC_RUN;
+        out = CodecPutVarint(out, run);
+    }
+    return out - start;
+}
+
+/* ===================================================================== */
+// Decoder
+/* ===================================================================== */
+
+// Decode exactly 'count' records from [in, in + bytes). Returns false if
+// the input is malformed
+static inline bool CodecDecode(CODEC_STATE * st, const uint8_t * in, size_t bytes, TRACE_RECORD * recs, uint32_t count)
+{
+    CodecReset(st);
+    const uint8_t * end = in + bytes;
+    uint64_t run = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        CODEC_SHAPE shape;
+        bool shapeHit = true;
+        bool dataHit = true;
+        if (run == 0)
+        {
+            if (in >= end)
+                return false;
+            uint8_t token = *in++;
+            if ((token & (CODEC_EXTENDED | CODEC_KIND_MASK)) == CODEC_RUN)
+            {
+                if (!(in = CodecGetVarint(in, end, &run)) || run == 0)
+                    return false;
+            }
+            else
+            {
+                shapeHit = token & CODEC_SHAPE_HIT;
+                dataHit = token & CODEC_DATA_HIT;
+                shape._kind = CodecKind(token);
+            }
+        }
+        if (run)
+            run--;
+
+        if (shapeHit)
+        {
+            shape = st->_next[CodecHash(st->_prevSite)];
+        }
+        else
+        {
+            uint64_t size, key;
+            if (!(in = CodecGetVarint(in, end, &size)) || !(in = CodecGetVarint(in, end, &key)))
+                return false;
+            shape._size = (uint32_t)size;
+            if (CodecIsReg(shape._kind))
+                shape._key = key;
+            else if (shape._kind == REC_VALUE)
+                shape._key = (uint64_t)CodecUnZigZag(key);
+            else
+                shape._key = st->_lastIp + (uint64_t)CodecUnZigZag(key);
+        }
+        if (shape._kind == CODEC_BAD_KIND)
+            return false;
+
+        uint64_t site = CodecSiteOf(st, shape._kind, shape._key);
+        CODEC_SITE * slot = &st->_sites[CodecHash(site)];
+        uint64_t data = 0;
+        if (CodecHasData(shape._kind))
+        {
+            if (dataHit)
+            {
+                if (slot->_tag != site)
+                    return false;
+                data = slot->_last + slot->_stride;
+            }
+            else
+            {
+                uint64_t delta;
+                if (!(in = CodecGetVarint(in, end, &delta)))
+                    return false;
+                uint64_t base = slot->_tag == site ? slot->_last : CodecIsMem(shape._kind) ? st->_lastEa : 0;
+                data = base + (uint64_t)CodecUnZigZag(delta);
+            }
+        }
+
+        TRACE_RECORD * rec = &recs[i];
+        rec->_kind = shape._kind;
+        rec->_size = shape._size;
+        rec->_ea = 0;
+        switch (shape._kind)
+        {
+          case REC_READ:
+          case REC_WRITE:
+            rec->_ip = shape._key;
+            rec->_ea = data;
+            break;
+          case REC_VALUE:
+            rec->_ea = st->_storeEa + shape._key;
+            rec->_value = data;
+            break;
+          case REC_REG:
+            rec->_value = data;
+            break;
+          case REC_VREG:
+            rec->_ea = shape._key;
+            rec->_value = data;
+            break;
+          case REC_SYSCALL:
+            rec->_ip = shape._key;
+            rec->_ea = data;
+            break;
+          case REC_STAMP:
+            rec->_value = data;
+            break;
+          default:
+            rec->_ip = shape._key;
+            break;
+        }
+
+        CodecUpdate(st, site, slot, shape, data, rec->_ea);
+    }
+    return run == 0 && in == end;
+}
+
+#endif
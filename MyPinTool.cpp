@@ -34,258 +34,4184 @@ END_LEGAL */
 //
 
 #include <fstream>
+#include <sstream>
 #include <iomanip>
 #include <iostream>
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <new>
+#include <set>
+#include <algorithm>
+#include <cpuid.h>
+#include <emmintrin.h>
 #include "pin.H"
 #include <cassert>
 #include "../Utils/regvalue_utils.h"
+#include "RecordFormat.h"
+#include "Codec.h"
+#include "ChunkSummary.h"
 
 
-#define BEFORE 0
-#define AFTER 1
+#define CACHE_LINE_SIZE 64
+
+// Number of general purpose registers snapshotted per routine
+#define NUM_GR (REG_GR_LAST - REG_GR_BASE + 1)
+
+#define GR_BIT(reg) (1u << ((reg) - REG_GR_BASE))
+
+// Registers a call may change under the System V ABI; callees restore
+// all the others before returning
+#define CALLER_SAVED_GR (GR_BIT(REG_RAX) | GR_BIT(REG_RCX) | GR_BIT(REG_RDX) | GR_BIT(REG_RSI) \
+    | GR_BIT(REG_RDI) | GR_BIT(REG_R8) | GR_BIT(REG_R9) | GR_BIT(REG_R10) | GR_BIT(REG_R11))
+
+// Registers the kernel may change across a syscall instruction
+#define SYSCALL_GR (GR_BIT(REG_RAX) | GR_BIT(REG_RCX) | GR_BIT(REG_R11))
+
+// Vector registers in TRACE_VREG numbering, as a mask. A call may change
+// all of them
+#define VREG_BIT(idx) (1ULL << (idx))
 
 ofstream outFile;
 
-// Holds instruction count for a single procedure
+// Binary recording of the execution, see RecordFormat.h
+ofstream traceFile;
+PIN_LOCK traceLock;
+
+// Seek index next to traceFile, one INDEX_ENTRY per chunk
+ofstream indexFile;
+
+// Where the next chunk goes, and what the recording holds so far.
+// Protected by traceLock
+UINT64 traceOffset = 0;
+UINT64 eventsWritten = 0;
+
+// Ordering stamps, see REC_STAMP. With the logical clock every thread
+// counts its own stamps, and the clocks only meet in syncClocks: a store
+// publishes the thread's clock to the slot of its cache line, and a load
+// from the line stamps the loading thread past it. Each slot has a host
+// cache line of its own, so threads only contend on slots for the lines
+// they share anyway, or for lines 4 MB apart. System calls meet in
+// kernelClock, the one slot every thread uses, but only around system
+// calls. A slot holds clock << 16 | SlotOwner
+#define SYNC_CLOCKS 65536
+typedef struct SyncSlot
+{
+    volatile UINT64 _clock;
+    UINT8 _pad[CACHE_LINE_SIZE - sizeof(UINT64)];
+} SYNC_SLOT;
+
+StampClock stampClock = STAMP_LOGICAL;
+UINT64 stampEvents = 0;
+SYNC_SLOT syncClocks[SYNC_CLOCKS] __attribute__((aligned(CACHE_LINE_SIZE)));
+volatile UINT64 kernelClock __attribute__((aligned(64))) = 0;
+
+// Each routine owns NUM_RTN_COUNTERS consecutive slots in every thread's
+// counters. Counters live in blocks of COUNTER_BLOCK_RTNS routines that
+// are allocated at instrumentation time, never by analysis code, so that
+// counting is a branch-free add Pin can inline
+#define COUNTER_BLOCK_RTNS 1024
+#define MAX_COUNTER_BLOCKS 4096
+
+// Levels of the -cache hierarchy: L1D, L2 and LLC
+#define CACHE_LEVELS 3
+
+enum RtnCounter
+{
+    CNT_CALLS = 0,
+    CNT_ICOUNT,
+    CNT_MEMACC,
+    CNT_READS,          // the -footprint counters
+    CNT_WRITES,
+    CNT_CALL_LINES,     // sum over calls of the lines each call touched
+    CNT_CACHE_ACCESSES, // the -cache counters, then the misses per level
+    CNT_L1_MISSES,
+    CNT_L2_MISSES,
+    CNT_LLC_MISSES,
+    NUM_RTN_COUNTERS
+};
+
+// What the tool itself costs, per thread: analysis calls by kind, then
+// CONTEXTs Pin built for our callbacks and the thread's buffer traffic
+enum ProfCounter
+{
+    PROF_COUNT_CALLS = 0,   // docount and the per-block counters, see CountCalls
+    PROF_READ_CALLS,
+    PROF_WRITE_CALLS,
+    PROF_VALUE_CALLS,
+    PROF_REG_CALLS,
+    PROF_VREG_CALLS,
+    PROF_ENTER_CALLS,
+    PROF_RETURN_CALLS,
+    PROF_STAMP_CALLS,
+    PROF_SYSCALL_CALLS,
+    PROF_FOOTPRINT_CALLS,
+    PROF_CACHE_CALLS,
+    PROF_BBV_CALLS,
+    PROF_CONTEXTS,
+    PROF_DRAINS,
+    PROF_DRAIN_US,          // compressing and queueing full buffers, stalls included
+    PROF_QUEUED_BYTES,
+    PROF_STALL_US,          // waiting for the writer, see -backpressure
+    PROF_LOAD_VALUES,       // -load_values: values logged for loads
+    PROF_ELIDED_VALUES,     // and left out because the shadow predicted them
+    NUM_PROF_COUNTERS
+};
+
+#define NUM_PROF_CALLS (PROF_BBV_CALLS + 1)
+
+static const char * const ProfNames[NUM_PROF_COUNTERS] =
+{
+    "count", "read", "write", "value", "register", "vector_register", "enter", "return", "stamp", "syscall",
+    "footprint", "cache", "bbv", "contexts", "drains", "drain_us", "queued_bytes", "stall_us",
+    "load_values", "elided_values"
+};
+
+// Holds instruction count for a single procedure. The counts are only
+// filled in by Fini, from the per-thread counters below
 typedef struct RtnCount
 {
-    string _name;
-    string _image;
+    const char * _name;         // interned, see Intern
+    const char * _image;
     ADDRINT _address;
-    RTN _rtn;
+    UINT32 _id;
+    BOOL _selected;             // passes the instrumentation filters
     UINT64 _rtnCount;
     UINT64 _icount;
     UINT64 _memacc;
-    struct RtnCount * _next;
+
+    // Blocks given a counting call and their instructions, see CountCalls
+    UINT32 _blocks;
+    UINT64 _blockIns;
+
+    // -footprint: accesses, and the distinct cache lines and pages touched
+    UINT64 _reads;
+    UINT64 _writes;
+    UINT64 _callLines;
+    UINT64 _lines;
+    UINT64 _readLines;
+    UINT64 _writeLines;
+    UINT64 _pages;
+
+    // -cache: line accesses and misses at every level
+    UINT64 _cacheAccesses;
+    UINT64 _misses[CACHE_LEVELS];
 } RTN_COUNT;
 
-// Linked list of instruction counts for each routine
-RTN_COUNT * RtnList = 0;
+// The routine table. Routines are numbered in the order they are seen and
+// live in blocks of COUNTER_BLOCK_RTNS, like their counters, so that the
+// table never moves and RtnById is two loads
+RTN_COUNT * RtnBlocks[MAX_COUNTER_BLOCKS];
+UINT32 numRtns = 0;
+
+// Routines are instrumented again every time the ROI starts or stops, so
+// find the counter a routine already has. Open addressing on the routine
+// address, holding id + 1 with 0 for a free slot
+UINT32 * RtnHash = 0;
+UINT32 rtnHashSize = 0;
+
+// Counter the Fini report is sorted by
+RtnCounter sortBy = CNT_ICOUNT;
+
+// Interned strings, packed into blocks that are never freed. StringHash
+// is open addressing on the contents, 0 being a free slot
+#define STRING_BLOCK_SIZE 65536
+char * stringBlock = 0;
+size_t stringLeft = 0;
+const char ** StringHash = 0;
+UINT32 stringHashSize = 0;
+UINT32 numStrings = 0;
+
+// Routines left out by the instrumentation filters, per image
+typedef struct SkipCount
+{
+    UINT64 _rtns;
+    UINT64 _bytes;
+} SKIP_COUNT;
+
+map<string, SKIP_COUNT> SkippedByImage;
+
+// Region of interest. Outside of it routines get no analysis calls other
+// than what is needed to notice the ROI starting
+volatile BOOL recording = true;
+UINT32 roiDepth = 0;
+PIN_LOCK roiLock;
+
+// Instructions left to execute before -skip starts the ROI
+volatile INT64 skipLeft = 0;
+
+// Record and count only in bursts of -sample_burst instructions
+BOOL sampling = false;
+
+// Every thread's execution is cut into intervals of -interval
+// instructions, for -bbv and -simpoints
+BOOL intervals = false;
+
+// Basic block vectors, see -bbv. Blocks are numbered from 1 in the order
+// they are seen, and every thread counts the instructions executed in
+// each block in slots allocated like the routine counters
+#define BBV_BLOCK_BBLS 4096
+#define MAX_BBV_BLOCKS 4096
+map<ADDRINT, UINT32> BblIds;
+UINT32 numBbls = 0;
+ofstream bbvFile;
+PIN_LOCK bbvLock;
+
+// Intervals to record with -simpoints, as (thread, interval)
+set<pair<UINT32, UINT64> > SimPoints;
+
+// With -sample_burst or -simpoints, whether a thread records is up to
+// its THREAD_DATA::_gate
+BOOL gated = false;
+
+// Footprint, see -footprint. Every thread keeps the set of (routine,
+// cache line) pairs it touched, open addressing with _flags == 0 for a
+// free slot. Fini merges them into the same kind of set
+#define FOOT_PAGE_LINES (4096 / CACHE_LINE_SIZE)
+
+enum FootFlags
+{
+    FOOT_READ = 1,
+    FOOT_WRITE = 2
+};
+
+typedef struct FootEntry
+{
+    ADDRINT _line;
+    UINT32 _rtn;
+    UINT32 _flags;
+    UINT64 _call;               // the routine's call count at the last touch
+} FOOT_ENTRY;
+
+typedef struct FootSet
+{
+    FOOT_ENTRY * _entries;
+    UINT32 _size;               // a power of two
+    UINT32 _used;
+} FOOT_SET;
+
+BOOL footprint = false;
+
+// Load values, see -load_values. Every thread keeps what its own REC_VALUE
+// records have said about memory, which is what a replay of the thread
+// knows too. Loads whose bytes all match it are not logged. Pages are
+// kept in an open addressing table, 0 for a free slot
+#define SHADOW_PAGE_SIZE 4096
+
+typedef struct ShadowPage
+{
+    ADDRINT _page;              // address / SHADOW_PAGE_SIZE
+    UINT8 _data[SHADOW_PAGE_SIZE];
+    UINT8 _known[SHADOW_PAGE_SIZE / 8];
+    BOOL _dirty;                // in a REPLAY_IMAGE, stored to since the last checkpoint
+} SHADOW_PAGE;
+
+typedef struct ShadowMemory
+{
+    SHADOW_PAGE ** _pages;
+    UINT32 _size;               // a power of two
+    UINT32 _used;
+    SHADOW_PAGE * _last;        // the page found last
+} SHADOW_MEMORY;
+
+BOOL loadValues = false;
+
+// Memory as a replay of the file so far sees it, in CKPT_PAGE_SIZE pages
+typedef struct ReplayImage
+{
+    SHADOW_MEMORY _pages;
+    vector<SHADOW_PAGE *> _dirty;
+} REPLAY_IMAGE;
+
+// Checkpoint bookkeeping, also protected by traceLock. The images are
+// built from the REC_VALUE records written, not from live memory, so a
+// checkpoint matches its position in the file. With -load_values every
+// thread also has the image of its own values. A checkpoint holds the
+// pages stored to since the one before it, and a keyframe all of them
+REPLAY_IMAGE replayImage;
+map<UINT32, REPLAY_IMAGE> threadImages;
+UINT64 numCheckpoints = 0;
+UINT64 lastCheckpointEvents = 0;
+UINT64 lastCheckpointMs = 0;
+BOOL keyframeDue = false;       // a thread's image started over
+
+// Width of the vector registers recorded, 16, 32 or 64 bytes, and how
+// many there are in TRACE_VREG numbering. 0 for none, see -vector_regs
+UINT32 vregBytes = 0;
+UINT32 numVregs = 0;
+
+// Cache simulation, see -cache. Every thread drives a private hierarchy
+// from a batch of its accesses; a miss at one level looks up the next.
+// A level's tags are an array of sets of _assoc lines each, so a lookup
+// scans one or two cache lines of tags. With LRU, every set is kept in
+// recency order; with PLRU, _plru holds the tree bits of every set
+#define CACHE_BATCH 1024
+
+enum CachePolicy
+{
+    POLICY_LRU,
+    POLICY_PLRU
+};
+
+typedef struct CacheLevel
+{
+    ADDRINT * _tags;            // line + 1, 0 for an empty way
+    UINT64 * _plru;
+    UINT32 _sets;               // a power of two
+    UINT32 _assoc;
+} CACHE_LEVEL;
+
+typedef struct CacheAccess
+{
+    ADDRINT _ea;
+    UINT32 _rtn;
+    UINT32 _size;
+} CACHE_ACCESS;
+
+BOOL cacheSim = false;
+CachePolicy cachePolicy = POLICY_LRU;
+UINT32 cacheLineShift = 6;
+UINT32 cacheSets[CACHE_LEVELS];
+UINT32 cacheAssoc[CACHE_LEVELS];
+
+// Calling-context tree, see -cct. Every thread grows its own tree under
+// a root with _rtn == NO_RTN, one node per distinct call path, and keeps
+// the exclusive costs in the node of the current context. Children are
+// a list kept in most recently called order. Fini merges the trees and
+// adds up the inclusive costs
+#define NO_RTN 0xffffffffu
+
+typedef struct CctNode
+{
+    UINT32 _rtn;                // routine id
+    struct CctNode * _parent;
+    struct CctNode * _child;
+    struct CctNode * _sibling;
+    UINT64 _calls;
+    UINT64 _icount;
+    UINT64 _memacc;
+    UINT64 _inclIcount;         // filled in by Fini
+    UINT64 _inclMemacc;
+} CCT_NODE;
+
+// One routine call on a thread's shadow stack. _sp is the stack pointer
+// at entry, where the return address is
+typedef struct Frame
+{
+    ADDRINT _rtn;
+    ADDRINT _sp;
+    CCT_NODE * _caller;
+    ADDRINT _regs[NUM_GR];      // the recorded registers after the entry ones
+} FRAME;
+
+BOOL cct = false;
+CCT_NODE * cctRoot = 0;         // the merged tree
+
+// Verification, see -verify. The recording is read back chunk by chunk
+// through verifyFile, under verifyLock; VerifyChunks holds the offsets
+// of every thread's chunks in file order
+ifstream verifyFile;
+PIN_LOCK verifyLock;
+map<UINT32, vector<UINT64> > VerifyChunks;
+BOOL verifying = false;
+UINT64 verifiedEvents = 0;
+
+// The first divergence any thread found. NO_RECORD as the _kind of
+// _expected or _actual means that side had no more events
+typedef struct Divergence
+{
+    BOOL _found;
+    UINT32 _tid;
+    UINT64 _event;              // index among the thread's events
+    ADDRINT _rtn;               // last routine entered before it
+    ADDRINT _ip;                // last instruction that accessed memory
+    TRACE_RECORD _expected;
+    TRACE_RECORD _actual;
+} DIVERGENCE;
+
+#define NO_RECORD 0xffffffffu
+
+DIVERGENCE divergence;
+
+// A thread's records on their way to traceFile. Threads fill one buffer
+// while the writer thread writes out the ones they filled before
+typedef struct OutBuffer
+{
+    TRACE_RECORD * _recs;
+    UINT8 * _packed;            // compressed _recs, with -compress
+
+    // Filled in when the buffer is queued
+    CHUNK_HEADER _chunk;
+    const VOID * _payload;
+    struct ThreadData * _td;
+    UINT64 _icount;
+    ADDRINT _rtn;
+    ADDRINT _regs[NUM_GR];      // the thread's replay state after the chunk
+    UINT8 _vregs[NUM_TRACE_VREG][TRACE_VREG_BYTES];
+    UINT32 _depth;
+    CHUNK_SUMMARY _summary;     // for the chunk's index entry
+
+    struct OutBuffer * _next;
+} OUT_BUFFER;
+
+// Records one instruction can hold back, see FlushLoads
+#define MAX_HELD 4
+
+// Everything a thread touches while executing, so that threads never
+// share a cache line or each other's register snapshot
+typedef struct ThreadData
+{
+    THREADID _tid;
+
+    // Record buffer, written to traceFile in bulk when it fills. _limit
+    // is _end, or the earlier record where a periodic stamp is due
+    TRACE_RECORD * _buf;
+    TRACE_RECORD * _cur;
+    TRACE_RECORD * _end;
+    TRACE_RECORD * _limit;
+
+    // _buf belongs to _out. Empty buffers come back from the writer on
+    // _free and are kept on _spare until needed
+    OUT_BUFFER * _out;
+    OUT_BUFFER * _spare;
+    OUT_BUFFER * volatile _free;
+    volatile BOOL _finished;
+
+    // Codec state for compressing a buffer when it drains, or for
+    // decoding the recording with -verify
+    CODEC_STATE * _codec;
+
+    // Stamp in effect where the next chunk starts, for its summary
+    UINT64 _chunkStamp;
+
+    // Last stamp the logical clock gave the thread
+    UINT64 _clock;
+
+    // -verify: the thread's next recorded chunk without its stamps, and
+    // where comparison is in it. _expectedEvents holds the index of each
+    // record in the chunk, which starts at event _verifiedEvents of the
+    // thread. _verifyRtn and _verifyIp locate the compared events
+    TRACE_RECORD * _expected;
+    UINT32 * _expectedEvents;
+    UINT32 _expectedRecords;
+    UINT32 _expectedCount;
+    UINT32 _expectedPos;
+    UINT32 _expectedCap;
+    UINT8 * _verifyPacked;
+    UINT32 _verifyPackedCap;
+    UINT32 _verifyChunk;
+    UINT64 _verifiedEvents;
+    ADDRINT _verifyRtn;
+    ADDRINT _verifyIp;
+    BOOL _verifyDone;
+
+    // Register values as last written to the recording, for deltas, and
+    // the ones a dropped buffer left the replay without, as GR_BIT and
+    // VREG_BIT masks
+    ADDRINT _regval[NUM_GR];
+    UINT8 _vregval[NUM_TRACE_VREG][TRACE_VREG_BYTES];
+    UINT32 _staleRegs;
+    UINT64 _staleVregs;
+
+    // Store in flight between IPOINT_BEFORE and IPOINT_AFTER
+    ADDRINT _writeEa;
+    UINT32 _writeSize;
+
+    // With the logical clock, the REC_READs of the instruction in flight
+    // and the REC_WRITEs after them, held back until it has loaded, see
+    // FlushLoads
+    TRACE_RECORD _held[MAX_HELD];
+    UINT32 _numHeld;
+
+    // System call in flight between its entry and exit callbacks
+    ADDRINT _sysIp;
+    ADDRINT _sysNum;
+    ADDRINT _sysArgs[6];
+
+    // vDSO call in flight, see VdsoCalls
+    ADDRINT _vdsoIp;
+    ADDRINT _vdsoNum;
+    ADDRINT _vdsoArgs[2];
+
+    // Instructions executed, routine depth and last routine entered
+    UINT64 _icount;
+    UINT32 _depth;
+    ADDRINT _rtn;
+
+    // Shadow call stack of _depth frames, and the -cct context
+    FRAME * _stack;
+    UINT32 _stackCap;
+    CCT_NODE * _ctx;
+    CCT_NODE * _cctRoot;
+
+    // Sampling, see -sample_burst. _sampleLeft counts instructions down
+    // to the end of the current period of _samplePeriod, which is either
+    // a burst or a gap. Completed periods add up in _totalIns and, for
+    // bursts, _sampledIns
+    INT64 _sampleLeft;
+    INT64 _samplePeriod;
+    ADDRINT _inBurst;
+    UINT64 _totalIns;
+    UINT64 _sampledIns;
+    UINT64 _nextBurstMs;
+
+    // Replay state as of the last record in traceFile, for checkpoints.
+    // Only touched with traceLock held
+    ADDRINT _fileRegs[NUM_GR];
+    UINT8 _fileVregs[NUM_TRACE_VREG][TRACE_VREG_BYTES];
+    UINT32 _fileDepth;
+    UINT64 _fileEvents;
+
+    // Routine counters, see COUNTER_BLOCK_RTNS
+    UINT64 * _counters[MAX_COUNTER_BLOCKS];
+
+    // Current interval, instructions left in it, and whether it is one of
+    // the -simpoints
+    UINT64 _interval;
+    INT64 _intervalLeft;
+    BOOL _inSimPoint;
+
+    // Nonzero while the thread is in a burst and in one of its -simpoints,
+    // see gated
+    ADDRINT _gate;
+
+    // Basic block vector of the current interval, see BBV_BLOCK_BBLS
+    UINT64 * _bbv[MAX_BBV_BLOCKS];
+
+    // Lines touched by every routine, for -footprint
+    FOOT_SET _footprint;
+
+    // Memory as the thread's logged values describe it, for -load_values
+    SHADOW_MEMORY _shadow;
+
+    // -cache hierarchy, and the accesses not simulated yet
+    CACHE_LEVEL _cache[CACHE_LEVELS];
+    CACHE_ACCESS * _cacheBatch;
+    UINT32 _cacheCount;
+
+    // Self profile, see ProfCounter. Other threads only ever read it
+    UINT64 _prof[NUM_PROF_COUNTERS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) THREAD_DATA;
+
+TLS_KEY tlsKey;
+
+// Tool register holding the thread's THREAD_DATA, so that inlined
+// analysis code can reach it without calling PIN_GetThreadData
+REG tdReg;
+
+// Contexts of every thread that ever started, merged in Fini
+vector<THREAD_DATA *> allThreads;
+PIN_LOCK threadsLock;
+
+// Background writer. Full buffers of all threads are pushed on writeQueue
+// without locking; whoever holds traceLock takes the whole queue and
+// writes it out, normally the writer thread
+OUT_BUFFER * volatile writeQueue = 0;
+PIN_SEMAPHORE writerSem;
+PIN_THREAD_UID writerUid;
+volatile BOOL writerRunning = false;
+volatile BOOL writerExit = false;
+
+// What a thread does when it needs an empty buffer and the writer has
+// not handed one back yet
+enum Backpressure
+{
+    BP_BLOCK,           // wait for the writer
+    BP_DROP,            // discard the full buffer and count what was lost
+    BP_GROW             // allocate another buffer
+};
+Backpressure backpressure = BP_BLOCK;
+
+// Backpressure statistics, updated atomically
+UINT64 writerStalls = 0;
+UINT64 droppedChunks = 0;
+UINT64 droppedRecords = 0;
+UINT64 grownBuffers = 0;
+
+// Time spent in our own instrumentation callbacks. Pin serializes them, so
+// plain counters are enough. Pin's own JIT time is not included
+UINT64 routineUs = 0;
+UINT64 traceUs = 0;
+UINT64 instrumentCalls = 0;
+
+// Time the writer spent writing and the chunks it wrote, with traceLock
+// held. Reads for -heartbeat_ms do without
+UINT64 writeUs = 0;
+UINT64 chunksWritten = 0;
+
+// -heartbeat_ms, kept by the writer thread
+UINT64 startMs = 0;
+UINT64 nextHeartbeatMs = 0;
+
+static inline THREAD_DATA * GetThreadData(THREADID tid)
+{
+    return static_cast<THREAD_DATA *>(PIN_GetThreadData(tlsKey, tid));
+}
+
+// Make sure the thread has counters for the first 'rtns' routine ids
+static VOID AllocCounters(THREAD_DATA * td, UINT32 rtns)
+{
+    for (UINT32 b = 0; b * COUNTER_BLOCK_RTNS < rtns; b++)
+    {
+        if (td->_counters[b])
+            continue;
+        td->_counters[b] = new UINT64[COUNTER_BLOCK_RTNS * NUM_RTN_COUNTERS];
+        memset(td->_counters[b], 0, COUNTER_BLOCK_RTNS * NUM_RTN_COUNTERS * sizeof(UINT64));
+    }
+}
+
+// Make sure the thread has basic block vector slots for ids below 'bbls'
+static VOID AllocBbv(THREAD_DATA * td, UINT32 bbls)
+{
+    for (UINT32 b = 0; b * BBV_BLOCK_BBLS < bbls; b++)
+    {
+        if (td->_bbv[b])
+            continue;
+        td->_bbv[b] = new UINT64[BBV_BLOCK_BBLS];
+        memset(td->_bbv[b], 0, BBV_BLOCK_BBLS * sizeof(UINT64));
+    }
+}
+
+static inline UINT64 * RtnCounters(THREAD_DATA * td, UINT32 id)
+{
+    return td->_counters[id / COUNTER_BLOCK_RTNS] + (id % COUNTER_BLOCK_RTNS) * NUM_RTN_COUNTERS;
+}
+
+// This function is called on routine entry and for predicated memory accesses
+VOID PIN_FAST_ANALYSIS_CALL docount(THREAD_DATA * td, UINT32 id, UINT32 counter)
+{
+    RtnCounters(td, id)[counter]++;
+}
+
+static inline UINT32 FootHash(UINT32 rtn, ADDRINT line)
+{
+    return (UINT32)((((UINT64)line ^ ((UINT64)rtn << 44)) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static VOID FootGrow(FOOT_SET * set)
+{
+    FOOT_SET bigger;
+    bigger._size = set->_size ? set->_size * 2 : 4096;
+    bigger._used = set->_used;
+    bigger._entries = new FOOT_ENTRY[bigger._size];
+    memset(bigger._entries, 0, bigger._size * sizeof(FOOT_ENTRY));
+    for (UINT32 i = 0; i < set->_size; i++)
+    {
+        const FOOT_ENTRY & e = set->_entries[i];
+        if (e._flags == 0)
+            continue;
+        UINT32 j = FootHash(e._rtn, e._line) & (bigger._size - 1);
+        while (bigger._entries[j]._flags)
+            j = (j + 1) & (bigger._size - 1);
+        bigger._entries[j] = e;
+    }
+    delete[] set->_entries;
+    *set = bigger;
+}
+
+// The entry of (rtn, line), added with no flags if it is new. The caller
+// must set a flag
+static FOOT_ENTRY * FootFind(FOOT_SET * set, UINT32 rtn, ADDRINT line)
+{
+    if (2 * (set->_used + 1) > set->_size)
+        FootGrow(set);
+    for (UINT32 i = FootHash(rtn, line) & (set->_size - 1); ; i = (i + 1) & (set->_size - 1))
+    {
+        FOOT_ENTRY * e = &set->_entries[i];
+        if (e->_flags == 0)
+        {
+            e->_line = line;
+            e->_rtn = rtn;
+            e->_call = ~(UINT64)0;
+            set->_used++;
+            return e;
+        }
+        if (e->_line == line && e->_rtn == rtn)
+            return e;
+    }
+}
+
+// One memory access of routine id, for -footprint
+VOID PIN_FAST_ANALYSIS_CALL FootprintAccess(THREAD_DATA * td, UINT32 id, ADDRINT addr, UINT32 size, UINT32 flag)
+{
+    td->_prof[PROF_FOOTPRINT_CALLS]++;
+    UINT64 * counters = RtnCounters(td, id);
+    counters[flag == FOOT_WRITE ? CNT_WRITES : CNT_READS]++;
+
+    ADDRINT last = (addr + (size ? size - 1 : 0)) / CACHE_LINE_SIZE;
+    for (ADDRINT line = addr / CACHE_LINE_SIZE; line <= last; line++)
+    {
+        FOOT_ENTRY * e = FootFind(&td->_footprint, id, line);
+        e->_flags |= flag;
+        if (e->_call != counters[CNT_CALLS])
+        {
+            e->_call = counters[CNT_CALLS];
+            counters[CNT_CALL_LINES]++;
+        }
+    }
+}
+
+// Way of the tree PLRU victim in a set with the given bits
+static inline UINT32 PlruVictim(UINT64 bits, UINT32 assoc)
+{
+    UINT32 node = 1;
+    while (node < assoc)
+        node = 2 * node + (UINT32)((bits >> node) & 1);
+    return node - assoc;
+}
+
+// Point every node on the path to way away from it
+static inline UINT64 PlruTouch(UINT64 bits, UINT32 assoc, UINT32 way)
+{
+    for (UINT32 node = way + assoc; node > 1; node /= 2)
+    {
+        UINT32 parent = node / 2;
+        bits = (bits & ~(1ULL << parent)) | ((UINT64)(~node & 1) << parent);
+    }
+    return bits;
+}
+
+// Look up line in one level and fill it on a miss. Returns true on a hit
+static BOOL CacheLookup(CACHE_LEVEL * level, ADDRINT line)
+{
+    UINT32 set = (UINT32)line & (level->_sets - 1);
+    ADDRINT * ways = level->_tags + (size_t)set * level->_assoc;
+    ADDRINT tag = line + 1;
+    UINT32 assoc = level->_assoc;
+
+    if (cachePolicy == POLICY_LRU)
+    {
+        UINT32 way = 0;
+        while (way < assoc - 1 && ways[way] != tag)
+            way++;
+        BOOL hit = ways[way] == tag;
+        for (; way > 0; way--)
+            ways[way] = ways[way - 1];
+        ways[0] = tag;
+        return hit;
+    }
+
+    UINT32 way = assoc;
+    for (UINT32 w = 0; w < assoc; w++)
+    {
+        if (ways[w] == tag)
+        {
+            level->_plru[set] = PlruTouch(level->_plru[set], assoc, w);
+            return true;
+        }
+        if (ways[w] == 0 && way == assoc)
+            way = w;
+    }
+    if (way == assoc)
+        way = PlruVictim(level->_plru[set], assoc);
+    ways[way] = tag;
+    level->_plru[set] = PlruTouch(level->_plru[set], assoc, way);
+    return false;
+}
+
+// Run the thread's batched accesses through its hierarchy. Every line an
+// access spans counts as an access of its own
+static VOID CacheFlush(THREAD_DATA * td)
+{
+    for (UINT32 i = 0; i < td->_cacheCount; i++)
+    {
+        const CACHE_ACCESS & a = td->_cacheBatch[i];
+        UINT64 * counters = RtnCounters(td, a._rtn);
+        ADDRINT last = (a._ea + (a._size ? a._size - 1 : 0)) >> cacheLineShift;
+        for (ADDRINT line = a._ea >> cacheLineShift; line <= last; line++)
+        {
+            counters[CNT_CACHE_ACCESSES]++;
+            for (UINT32 l = 0; l < CACHE_LEVELS && !CacheLookup(&td->_cache[l], line); l++)
+                counters[CNT_L1_MISSES + l]++;
+        }
+    }
+    td->_cacheCount = 0;
+}
+
+// One memory access of routine id, for -cache
+VOID PIN_FAST_ANALYSIS_CALL CacheRecord(THREAD_DATA * td, UINT32 id, ADDRINT addr, UINT32 size)
+{
+    td->_prof[PROF_CACHE_CALLS]++;
+    CACHE_ACCESS * a = &td->_cacheBatch[td->_cacheCount];
+    a->_ea = addr;
+    a->_rtn = id;
+    a->_size = size;
+    if (++td->_cacheCount == CACHE_BATCH)
+        CacheFlush(td);
+}
+
+static VOID AllocCache(THREAD_DATA * td)
+{
+    for (UINT32 l = 0; l < CACHE_LEVELS; l++)
+    {
+        CACHE_LEVEL * level = &td->_cache[l];
+        size_t ways = (size_t)cacheSets[l] * cacheAssoc[l];
+        level->_sets = cacheSets[l];
+        level->_assoc = cacheAssoc[l];
+        level->_tags = new ADDRINT[ways];
+        memset(level->_tags, 0, ways * sizeof(ADDRINT));
+        level->_plru = new UINT64[level->_sets];
+        memset(level->_plru, 0, level->_sets * sizeof(UINT64));
+    }
+    td->_cacheBatch = new CACHE_ACCESS[CACHE_BATCH];
+}
+
+static VOID FreeCache(THREAD_DATA * td)
+{
+    for (UINT32 l = 0; l < CACHE_LEVELS; l++)
+    {
+        delete[] td->_cache[l]._tags;
+        delete[] td->_cache[l]._plru;
+    }
+    delete[] td->_cacheBatch;
+    memset(td->_cache, 0, sizeof(td->_cache));
+    td->_cacheBatch = 0;
+}
+
+// This function is called before every basic block, with the number of
+// instructions and memory accesses it contains
+VOID PIN_FAST_ANALYSIS_CALL CountBbl(THREAD_DATA * td, UINT32 id, UINT32 numIns, UINT32 numMem)
+{
+    UINT64 * counters = RtnCounters(td, id);
+    counters[CNT_ICOUNT] += numIns;
+    counters[CNT_MEMACC] += numMem;
+    td->_icount += numIns;
+}
+
+// CountBbl that also charges the current calling context
+VOID PIN_FAST_ANALYSIS_CALL CountBblCct(THREAD_DATA * td, UINT32 id, UINT32 numIns, UINT32 numMem)
+{
+    UINT64 * counters = RtnCounters(td, id);
+    counters[CNT_ICOUNT] += numIns;
+    counters[CNT_MEMACC] += numMem;
+    td->_icount += numIns;
+    td->_ctx->_icount += numIns;
+    td->_ctx->_memacc += numMem;
+}
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "proccount.out", "specify output file name");
+
+KNOB<BOOL>   KnobCount(KNOB_MODE_WRITEONCE,  "pintool",
+    "count", "1", "count instructions and memory accesses of every routine per basic block");
+
+KNOB<string> KnobTraceFile(KNOB_MODE_WRITEONCE, "pintool", "trace", "mypintool.trace", "specify binary trace file name");
+
+KNOB<UINT32> KnobBufferRecords(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer", "65536", "number of trace records buffered per thread before writing");
+
+KNOB<UINT32> KnobWriterBuffers(KNOB_MODE_WRITEONCE, "pintool",
+    "writer_buffers", "3", "number of record buffers per thread, at least 2");
+
+KNOB<string> KnobBackpressure(KNOB_MODE_WRITEONCE, "pintool",
+    "backpressure", "block", "when the writer falls behind: block, drop (and count) or grow");
+
+KNOB<BOOL>   KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+    "compress", "1", "compress the trace records of every chunk, see Codec.h");
+
+KNOB<BOOL>   KnobStoreValues(KNOB_MODE_WRITEONCE, "pintool",
+    "values", "1", "record the data written by every store, needed to replay memory");
+
+KNOB<BOOL>   KnobLoadValues(KNOB_MODE_WRITEONCE, "pintool",
+    "load_values", "0", "also record the data loads read, except what the thread's earlier values predict");
+
+KNOB<BOOL>   KnobVectorRegs(KNOB_MODE_WRITEONCE, "pintool",
+    "vector_regs", "1", "also record the xmm/ymm/zmm and mask registers a routine changes");
+
+KNOB<BOOL>   KnobSyscalls(KNOB_MODE_WRITEONCE, "pintool",
+    "syscalls", "1", "record system call results and the user memory the kernel wrote");
+
+KNOB<string> KnobStamp(KNOB_MODE_WRITEONCE, "pintool",
+    "stamp", "logical", "clock of the cross-thread ordering stamps: logical, tsc or none");
+
+KNOB<UINT64> KnobStampEvents(KNOB_MODE_WRITEONCE, "pintool",
+    "stamp_events", "4096", "also stamp every this many events of a thread, 0 for synchronization points only");
+
+KNOB<UINT64> KnobCheckpointEvents(KNOB_MODE_WRITEONCE, "pintool",
+    "checkpoint", "16777216", "write a replay checkpoint every this many events, 0 for none");
+
+KNOB<UINT64> KnobCheckpointMs(KNOB_MODE_WRITEONCE, "pintool",
+    "checkpoint_ms", "0", "also write a replay checkpoint every this many milliseconds");
+
+KNOB<UINT64> KnobCheckpointKeyframe(KNOB_MODE_WRITEONCE, "pintool",
+    "checkpoint_keyframe", "16", "make every this many checkpoints hold all of memory; the ones "
+    "between hold the pages stored to since the last");
+
+KNOB<string> KnobRoiStart(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_start", "", "start recording when the routine with this name is called");
+
+KNOB<string> KnobRoiStop(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_stop", "", "stop recording when the routine with this name is called");
+
+KNOB<string> KnobRoiRtn(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_rtn", "", "record only while the routine with this name is running");
+
+KNOB<UINT64> KnobSkip(KNOB_MODE_WRITEONCE, "pintool",
+    "skip", "0", "start recording after this many instructions");
+
+KNOB<UINT64> KnobSampleBurst(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_burst", "0", "record only bursts of this many instructions, 0 to record everything");
+
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_period", "1000000", "start a burst every this many instructions");
+
+KNOB<UINT64> KnobSampleMs(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_ms", "0", "start a burst every this many milliseconds instead");
+
+KNOB<string> KnobBbv(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv", "", "write the basic block vector of every interval to this file instead of recording");
+
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "interval", "10000000", "instructions per thread in a -bbv or -simpoints interval");
+
+KNOB<string> KnobSimPoints(KNOB_MODE_WRITEONCE, "pintool",
+    "simpoints", "", "record only the intervals listed in this file, see offline/SimPoint.cpp");
+
+KNOB<string> KnobVerify(KNOB_MODE_WRITEONCE, "pintool",
+    "verify", "", "compare the execution against this recording instead of recording, run with its knobs. "
+    "Stamps are not compared and -stamp is none. Events are compared record for record whenever a thread's "
+    "buffer fills, so a divergence is found up to -buffer events after it, but reported at its own event");
+
+KNOB<BOOL>   KnobVerifyValues(KNOB_MODE_WRITEONCE, "pintool",
+    "verify_values", "1", "with -verify, also compare the data of every store");
+
+KNOB<BOOL>   KnobVerifyExit(KNOB_MODE_WRITEONCE, "pintool",
+    "verify_exit", "1", "with -verify, end the program at the first divergence");
+
+KNOB<BOOL>   KnobFootprint(KNOB_MODE_WRITEONCE, "pintool",
+    "footprint", "0", "report the cache lines and pages every routine touches instead of recording");
+
+KNOB<BOOL>   KnobCache(KNOB_MODE_WRITEONCE, "pintool",
+    "cache", "0", "simulate a cache hierarchy and report misses per routine instead of recording");
+
+KNOB<UINT32> KnobCacheLine(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_line", "64", "line size of the simulated caches in bytes, a power of two");
+
+KNOB<string> KnobCachePolicy(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_policy", "lru", "replacement policy of the simulated caches: lru or plru");
+
+KNOB<UINT32> KnobL1Size(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_size", "32", "size of the simulated L1 data cache in KB");
+
+KNOB<UINT32> KnobL1Assoc(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_assoc", "8", "associativity of the simulated L1 data cache");
+
+KNOB<UINT32> KnobL2Size(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_size", "1024", "size of the simulated L2 cache in KB");
+
+KNOB<UINT32> KnobL2Assoc(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_assoc", "16", "associativity of the simulated L2 cache");
+
+KNOB<UINT32> KnobLlcSize(KNOB_MODE_WRITEONCE, "pintool",
+    "llc_size", "8192", "size of the simulated last level cache in KB");
+
+KNOB<UINT32> KnobLlcAssoc(KNOB_MODE_WRITEONCE, "pintool",
+    "llc_assoc", "16", "associativity of the simulated last level cache");
+
+KNOB<string> KnobCct(KNOB_MODE_WRITEONCE, "pintool",
+    "cct", "", "write the calling-context tree to this file and report the hottest call paths");
+
+KNOB<UINT32> KnobTop(KNOB_MODE_WRITEONCE, "pintool",
+    "top", "100", "report only this many routines, 0 for all");
+
+KNOB<string> KnobSort(KNOB_MODE_WRITEONCE, "pintool",
+    "sort", "instructions", "order the report by calls, instructions, memory or misses (last level, with -cache)");
+
+KNOB<string> KnobReport(KNOB_MODE_WRITEONCE, "pintool",
+    "report", "text", "format of the report: text, csv or json");
+
+KNOB<UINT64> KnobHeartbeatMs(KNOB_MODE_WRITEONCE, "pintool",
+    "heartbeat_ms", "0", "print a line of the tool's own overhead counters to stderr this often, 0 for never");
+
+KNOB<BOOL>   KnobMainOnly(KNOB_MODE_WRITEONCE, "pintool",
+    "main_only", "0", "instrument only routines of the main executable");
 
-//for register Deltas
-ADDRINT regval[24];
+KNOB<string> KnobImageInclude(KNOB_MODE_APPEND, "pintool",
+    "image_include", "", "instrument only images whose file name matches this glob, may be repeated");
+
+KNOB<string> KnobImageExclude(KNOB_MODE_APPEND, "pintool",
+    "image_exclude", "", "do not instrument images whose file name matches this glob, may be repeated");
+
+KNOB<string> KnobRtnInclude(KNOB_MODE_APPEND, "pintool",
+    "rtn_include", "", "instrument only routines whose name matches this glob, may be repeated");
+
+KNOB<string> KnobRtnExclude(KNOB_MODE_APPEND, "pintool",
+    "rtn_exclude", "", "do not instrument routines whose name matches this glob, may be repeated");
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
+
+const char * StripPath(const char * path)
+{
+    const char * file = strrchr(path,'/');
+    if (file)
+        return file+1;
+    else
+        return path;
+}
+
+
+static UINT64 NowMs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+static UINT64 NowUs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+// Adds the lifetime of the enclosing instrumentation callback to total,
+// whichever way the callback returns
+class INSTRUMENT_TIMER
+{
+  public:
+    INSTRUMENT_TIMER(UINT64 & total) : _total(total), _start(NowUs()) {}
+    ~INSTRUMENT_TIMER()
+    {
+        _total += NowUs() - _start;
+        instrumentCalls++;
+    }
+
+  private:
+    UINT64 & _total;
+    UINT64 _start;
+};
+
+// Append a chunk and its _bytes of payload to traceFile and its entry to
+// indexFile. Checkpoints have no summary. Called with traceLock held
+static VOID WriteChunk(const CHUNK_HEADER & chunk, const VOID * payload, UINT64 icount, ADDRINT rtn,
+                       const CHUNK_SUMMARY * summary)
+{
+    INDEX_ENTRY entry;
+    memset(&entry, 0, sizeof(entry));
+    entry._event = eventsWritten;
+    entry._offset = traceOffset;
+    entry._icount = icount;
+    entry._rtn = rtn;
+    entry._tid = chunk._tid;
+    entry._count = chunk._count;
+    if (summary)
+        entry._summary = *summary;
+    indexFile.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+
+    traceFile.write(reinterpret_cast<const char *>(&chunk), sizeof(chunk));
+    traceFile.write(reinterpret_cast<const char *>(payload), chunk._bytes);
+    traceOffset += sizeof(chunk) + chunk._bytes;
+}
+
+static VOID PushRecord(vector<TRACE_RECORD> & recs, UINT64 value, UINT64 addr, UINT32 size, UINT32 kind)
+{
+    TRACE_RECORD rec;
+    rec._value = value;
+    rec._ea = addr;
+    rec._size = size;
+    rec._kind = kind;
+    recs.push_back(rec);
+}
+
+static inline UINT32 ShadowHash(ADDRINT page)
+{
+    return (UINT32)(((UINT64)page * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static VOID ShadowGrow(SHADOW_MEMORY * sm)
+{
+    UINT32 size = sm->_size ? sm->_size * 2 : 1024;
+    SHADOW_PAGE ** pages = new SHADOW_PAGE *[size];
+    memset(pages, 0, size * sizeof(SHADOW_PAGE *));
+    for (UINT32 i = 0; i < sm->_size; i++)
+    {
+        SHADOW_PAGE * p = sm->_pages[i];
+        if (!p)
+            continue;
+        UINT32 j = ShadowHash(p->_page) & (size - 1);
+        while (pages[j])
+            j = (j + 1) & (size - 1);
+        pages[j] = p;
+    }
+    delete[] sm->_pages;
+    sm->_pages = pages;
+    sm->_size = size;
+}
+
+// The shadow page holding addr. Returns 0 if there is none and create is
+// false
+static SHADOW_PAGE * ShadowFind(SHADOW_MEMORY * sm, ADDRINT addr, BOOL create)
+{
+    ADDRINT page = addr / SHADOW_PAGE_SIZE;
+    if (sm->_last && sm->_last->_page == page)
+        return sm->_last;
+    if (create && 2 * (sm->_used + 1) > sm->_size)
+        ShadowGrow(sm);
+    if (sm->_size == 0)
+        return 0;
+
+    SHADOW_PAGE * p;
+    for (UINT32 i = ShadowHash(page) & (sm->_size - 1); ; i = (i + 1) & (sm->_size - 1))
+    {
+        p = sm->_pages[i];
+        if (p && p->_page == page)
+            break;
+        if (!p)
+        {
+            if (!create)
+                return 0;
+            p = new SHADOW_PAGE;
+            memset(p, 0, sizeof(*p));
+            p->_page = page;
+            sm->_pages[i] = p;
+            sm->_used++;
+            break;
+        }
+    }
+    sm->_last = p;
+    return p;
+}
+
+static VOID FreeShadow(SHADOW_MEMORY * sm)
+{
+    for (UINT32 i = 0; i < sm->_size; i++)
+        delete sm->_pages[i];
+    delete[] sm->_pages;
+    memset(sm, 0, sizeof(*sm));
+}
+
+// Apply one REC_VALUE to image as offline/Replayer.cpp does
+static VOID ImageStore(REPLAY_IMAGE & image, ADDRINT addr, UINT64 value, UINT32 size)
+{
+    const UINT8 * src = reinterpret_cast<const UINT8 *>(&value);
+    while (size > 0)
+    {
+        UINT32 off = addr % CKPT_PAGE_SIZE;
+        UINT32 n = CKPT_PAGE_SIZE - off < size ? CKPT_PAGE_SIZE - off : size;
+        SHADOW_PAGE * page = ShadowFind(&image._pages, addr, true);
+        memcpy(page->_data + off, src, n);
+        for (UINT32 i = off; i < off + n; i++)
+            page->_known[i / 8] |= 1 << (i % 8);
+        if (!page->_dirty)
+        {
+            page->_dirty = true;
+            image._dirty.push_back(page);
+        }
+        addr += n;
+        src += n;
+        size -= n;
+    }
+}
+
+static VOID PushPage(vector<TRACE_RECORD> & recs, const SHADOW_PAGE * page, UINT64 owner)
+{
+    TRACE_RECORD data[CKPT_PAGE_RECORDS];
+    memset(data, 0, sizeof(data));
+    memcpy(data, page->_data, CKPT_PAGE_SIZE);
+    memcpy(reinterpret_cast<UINT8 *>(data) + CKPT_PAGE_SIZE, page->_known, CKPT_PAGE_SIZE / 8);
+    PushRecord(recs, owner, page->_page * CKPT_PAGE_SIZE, CKPT_PAGE_SIZE, REC_CKPT_PAGE);
+    recs.insert(recs.end(), data, data + CKPT_PAGE_RECORDS);
+}
+
+// Append a REC_CKPT_PAGE of the given owner for every page of image, or
+// for a delta only the ones stored to since the last checkpoint
+static VOID PushImage(vector<TRACE_RECORD> & recs, REPLAY_IMAGE & image, UINT64 owner, BOOL keyframe)
+{
+    if (keyframe)
+    {
+        for (UINT32 i = 0; i < image._pages._size; i++)
+        {
+            if (image._pages._pages[i])
+                PushPage(recs, image._pages._pages[i], owner);
+        }
+    }
+    for (size_t i = 0; i < image._dirty.size(); i++)
+    {
+        if (!keyframe)
+            PushPage(recs, image._dirty[i], owner);
+        image._dirty[i]->_dirty = false;
+    }
+    image._dirty.clear();
+}
+
+static VOID FreeImage(REPLAY_IMAGE & image)
+{
+    FreeShadow(&image._pages);
+    image._dirty.clear();
+}
+
+// Write a checkpoint chunk: every thread's replay state and the pages
+// stored to since the last checkpoint, or all of them in a keyframe. A
+// replay restores the last keyframe before where it starts and the
+// checkpoints after it. Called with traceLock held
+static VOID WriteCheckpoint(THREADID tid)
+{
+    BOOL keyframe = keyframeDue || numCheckpoints % KnobCheckpointKeyframe.Value() == 0;
+    vector<TRACE_RECORD> recs;
+    PushRecord(recs, numCheckpoints, eventsWritten, keyframe ? 1 : 0, REC_CHECKPOINT);
+
+    PIN_GetLock(&threadsLock, tid + 1);
+    for (size_t t = 0; t < allThreads.size(); t++)
+    {
+        THREAD_DATA * td = allThreads[t];
+        PushRecord(recs, td->_fileEvents, td->_fileDepth, td->_tid, REC_CKPT_THREAD);
+        for (UINT32 reg = 0; reg < NUM_GR; reg++)
+            PushRecord(recs, td->_fileRegs[reg], 0, reg, REC_REG);
+        for (UINT32 idx = 0; idx < numVregs; idx++)
+        {
+            for (UINT32 off = 0; off < TRACE_VREG_BYTES; off += sizeof(UINT64))
+            {
+                UINT64 q;
+                memcpy(&q, td->_fileVregs[idx] + off, sizeof(q));
+                if (q)
+                    PushRecord(recs, q, off, idx, REC_VREG);
+            }
+        }
+        map<UINT32, REPLAY_IMAGE>::iterator own = threadImages.find(td->_tid);
+        if (own != threadImages.end())
+            PushImage(recs, own->second, td->_tid + 1, keyframe);
+    }
+    PIN_ReleaseLock(&threadsLock);
+    PushImage(recs, replayImage, 0, keyframe);
+
+    CHUNK_HEADER chunk;
+    chunk._tid = CHECKPOINT_TID;
+    chunk._count = recs.size();
+    chunk._bytes = recs.size() * sizeof(TRACE_RECORD);
+    chunk._encoding = CHUNK_RAW;
+    WriteChunk(chunk, &recs[0], 0, 0, 0);
+
+    numCheckpoints++;
+    keyframeDue = false;
+    lastCheckpointEvents = eventsWritten;
+    lastCheckpointMs = NowMs();
+}
+
+static BOOL CheckpointDue()
+{
+    if (KnobCheckpointEvents.Value() && eventsWritten - lastCheckpointEvents >= KnobCheckpointEvents.Value())
+        return true;
+    return KnobCheckpointMs.Value() && NowMs() - lastCheckpointMs >= KnobCheckpointMs.Value();
+}
+
+static OUT_BUFFER * NewBuffer(THREAD_DATA * td)
+{
+    OUT_BUFFER * out = new OUT_BUFFER;
+    memset(out, 0, sizeof(*out));
+    out->_recs = new TRACE_RECORD[KnobBufferRecords.Value()];
+    if (KnobCompress.Value())
+        out->_packed = new UINT8[CODEC_MAX_BYTES(KnobBufferRecords.Value())];
+    out->_td = td;
+    return out;
+}
+
+static VOID DeleteBuffers(OUT_BUFFER * list)
+{
+    while (list)
+    {
+        OUT_BUFFER * next = list->_next;
+        delete[] list->_recs;
+        delete[] list->_packed;
+        delete list;
+        list = next;
+    }
+}
+
+// Lock-free stack of buffers. Any thread may push; taking always empties
+// the whole stack, so there is no ABA problem
+static VOID PushBuffer(OUT_BUFFER * volatile * stack, OUT_BUFFER * out)
+{
+    OUT_BUFFER * head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+    do
+    {
+        out->_next = head;
+    } while (!__atomic_compare_exchange_n(stack, &head, out, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// Returns the buffers that were on the stack, newest first
+static OUT_BUFFER * TakeBuffers(OUT_BUFFER * volatile * stack)
+{
+    return __atomic_exchange_n(stack, (OUT_BUFFER *)0, __ATOMIC_SEQ_CST);
+}
+
+// Give a written buffer back to its thread, or free it if the thread has
+// ended. Whichever of this and ThreadFini empties _free last frees it
+static VOID ReturnBuffer(OUT_BUFFER * out)
+{
+    THREAD_DATA * td = out->_td;
+    PushBuffer(&td->_free, out);
+    if (__atomic_load_n(&td->_finished, __ATOMIC_SEQ_CST))
+        DeleteBuffers(TakeBuffers(&td->_free));
+}
+
+// Write one queued buffer as a chunk. Called with traceLock held
+static VOID WriteBuffer(OUT_BUFFER * out, THREADID tid)
+{
+    THREAD_DATA * td = out->_td;
+    WriteChunk(out->_chunk, out->_payload, out->_icount, out->_rtn, &out->_summary);
+    eventsWritten += out->_chunk._count;
+
+    // Everything the thread recorded up to here is in the file now
+    memcpy(td->_fileRegs, out->_regs, sizeof(td->_fileRegs));
+    if (numVregs)
+        memcpy(td->_fileVregs, out->_vregs, sizeof(td->_fileVregs));
+    td->_fileDepth = out->_depth;
+    td->_fileEvents += out->_chunk._count;
+
+    if (KnobCheckpointEvents.Value() || KnobCheckpointMs.Value())
+    {
+        REPLAY_IMAGE * own = loadValues ? &threadImages[td->_tid] : 0;
+        for (const TRACE_RECORD * rec = out->_recs; rec < out->_recs + out->_chunk._count; rec++)
+        {
+            // A gap starts the thread's own values over, see REC_GAP. The
+            // replay only forgets them at a keyframe
+            if (rec->_kind == REC_GAP && own && own->_pages._used)
+            {
+                FreeImage(*own);
+                keyframeDue = true;
+            }
+            if (rec->_kind != REC_VALUE || rec->_size > sizeof(rec->_value))
+                continue;
+            ImageStore(replayImage, rec->_ea, rec->_value, rec->_size);
+            if (own)
+                ImageStore(*own, rec->_ea, rec->_value, rec->_size);
+        }
+        if (CheckpointDue())
+            WriteCheckpoint(tid);
+    }
+}
+
+// Write everything queued so far
+static VOID WriteQueued(THREADID tid)
+{
+    PIN_GetLock(&traceLock, tid + 1);
+    UINT64 start = NowUs();
+
+    // Reverse the stack so that every thread's chunks stay in order
+    OUT_BUFFER * fifo = 0;
+    OUT_BUFFER * list = TakeBuffers(&writeQueue);
+    while (list)
+    {
+        OUT_BUFFER * next = list->_next;
+        list->_next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo)
+    {
+        OUT_BUFFER * next = fifo->_next;
+        WriteBuffer(fifo, tid);
+        ReturnBuffer(fifo);
+        fifo = next;
+        chunksWritten++;
+    }
+    writeUs += NowUs() - start;
+    PIN_ReleaseLock(&traceLock);
+}
+
+// The counting calls of a thread. They are not counted as they happen,
+// so that counting stays a single add: routine entries are CNT_CALLS,
+// and the block calls are estimated from each routine's instructions and
+// the mean size of its counted blocks. Predicated accesses' calls are
+// left out
+static UINT64 CountCalls(THREAD_DATA * td)
+{
+    UINT64 calls = 0;
+    for (UINT32 b = 0; b * COUNTER_BLOCK_RTNS < numRtns; b++)
+    {
+        if (!td->_counters[b])
+            continue;
+        for (UINT32 i = 0; i < COUNTER_BLOCK_RTNS && b * COUNTER_BLOCK_RTNS + i < numRtns; i++)
+        {
+            const UINT64 * counters = td->_counters[b] + i * NUM_RTN_COUNTERS;
+            const RTN_COUNT * rc = &RtnBlocks[b][i];
+            calls += counters[CNT_CALLS];
+            if (rc->_blockIns)
+                calls += counters[CNT_ICOUNT] * rc->_blocks / rc->_blockIns;
+        }
+    }
+    return calls;
+}
+
+// The self profile of all threads. Counters of running threads are read
+// without synchronization, so a heartbeat may be slightly behind
+static VOID SumProfile(THREADID tid, UINT64 * prof)
+{
+    memset(prof, 0, NUM_PROF_COUNTERS * sizeof(UINT64));
+    PIN_GetLock(&threadsLock, tid + 1);
+    for (size_t t = 0; t < allThreads.size(); t++)
+    {
+        for (UINT32 c = 0; c < NUM_PROF_COUNTERS; c++)
+            prof[c] += allThreads[t]->_prof[c];
+        prof[PROF_COUNT_CALLS] += CountCalls(allThreads[t]);
+    }
+    PIN_ReleaseLock(&threadsLock);
+}
+
+// One line on where the time goes so far, for long production runs
+static VOID Heartbeat(THREADID tid)
+{
+    UINT64 prof[NUM_PROF_COUNTERS];
+    SumProfile(tid, prof);
+    UINT64 calls = 0;
+    for (UINT32 c = 0; c < NUM_PROF_CALLS; c++)
+        calls += prof[c];
+    cerr << "heartbeat " << NowMs() - startMs << " ms:"
+         << " instrumentation " << (routineUs + traceUs) / 1000 << " ms,"
+         << " analysis calls " << calls << ","
+         << " contexts " << prof[PROF_CONTEXTS] << ","
+         << " drains " << prof[PROF_DRAINS] << " (" << prof[PROF_DRAIN_US] / 1000 << " ms),"
+         << " written " << traceOffset << " bytes (" << writeUs / 1000 << " ms),"
+         << " stalls " << writerStalls << " (" << prof[PROF_STALL_US] / 1000 << " ms)" << endl;
+}
+
+// Owns the writing of traceFile while the program runs, so that threads
+// only ever queue their full buffers
+static VOID WriterThread(VOID * arg)
+{
+    THREADID tid = PIN_ThreadId();
+    while (!writerExit)
+    {
+        PIN_SemaphoreTimedWait(&writerSem, 100);
+        PIN_SemaphoreClear(&writerSem);
+        WriteQueued(tid);
+        if (KnobHeartbeatMs.Value() && NowMs() >= nextHeartbeatMs)
+        {
+            Heartbeat(tid);
+            nextHeartbeatMs = NowMs() + KnobHeartbeatMs.Value();
+        }
+    }
+    WriteQueued(tid);
+}
+
+// An empty buffer for the thread, applying -backpressure if the writer
+// has not handed one back yet. Returns 0 if the full buffer is to be
+// dropped instead
+static OUT_BUFFER * NextBuffer(THREAD_DATA * td)
+{
+    UINT64 stalled = 0;
+    for (;;)
+    {
+        if (!td->_spare)
+            td->_spare = TakeBuffers(&td->_free);
+        if (td->_spare)
+        {
+            OUT_BUFFER * out = td->_spare;
+            td->_spare = out->_next;
+            if (stalled)
+                td->_prof[PROF_STALL_US] += NowUs() - stalled;
+            return out;
+        }
+
+        // Without the writer, writing the queue frees this thread's buffers
+        if (!writerRunning)
+        {
+            WriteQueued(td->_tid);
+            continue;
+        }
+
+        switch (backpressure)
+        {
+          case BP_DROP:
+            return 0;
+          case BP_GROW:
+            __atomic_add_fetch(&grownBuffers, 1, __ATOMIC_RELAXED);
+            return NewBuffer(td);
+          default:
+            if (!stalled)
+            {
+                __atomic_add_fetch(&writerStalls, 1, __ATOMIC_RELAXED);
+                stalled = NowUs();
+            }
+            PIN_SemaphoreSet(&writerSem);
+            PIN_Sleep(1);
+            break;
+        }
+    }
+}
+
+/* ===================================================================== */
+// Verification
+/* ===================================================================== */
+
+// Find the event chunks of every thread in the recording at path
+static BOOL ReadVerifyChunks(const string & path)
+{
+    verifyFile.open(path.c_str(), ios::in | ios::binary);
+    TRACE_HEADER header;
+    if (!verifyFile.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || strncmp(header._magic, TRACE_MAGIC, sizeof(header._magic)) != 0
+        || header._version != TRACE_VERSION || header._recordSize != sizeof(TRACE_RECORD))
+        return false;
+    // Loads and vector registers are checked if the recording has them
+    loadValues = (header._flags & TRACE_LOAD_VALUES) != 0;
+    vregBytes = header._vregBytes;
+
+    UINT64 offset = sizeof(header);
+    CHUNK_HEADER chunk;
+    while (verifyFile.seekg(offset).read(reinterpret_cast<char *>(&chunk), sizeof(chunk)))
+    {
+        if (chunk._tid != CHECKPOINT_TID)
+            VerifyChunks[chunk._tid].push_back(offset);
+        offset += sizeof(chunk) + chunk._bytes;
+    }
+    verifyFile.clear();
+    return true;
+}
+
+// Load the thread's next recorded chunk. Returns false if there is none
+// or it cannot be read
+static BOOL NextExpected(THREAD_DATA * td)
+{
+    CHUNK_HEADER chunk;
+    PIN_GetLock(&verifyLock, td->_tid + 1);
+    map<UINT32, vector<UINT64> >::const_iterator it = VerifyChunks.find(td->_tid);
+    BOOL ok = it != VerifyChunks.end() && td->_verifyChunk < it->second.size()
+        && verifyFile.seekg(it->second[td->_verifyChunk]).read(reinterpret_cast<char *>(&chunk), sizeof(chunk));
+    if (ok && chunk._bytes > td->_verifyPackedCap)
+    {
+        delete[] td->_verifyPacked;
+        td->_verifyPacked = new UINT8[chunk._bytes];
+        td->_verifyPackedCap = chunk._bytes;
+    }
+    ok = ok && verifyFile.read(reinterpret_cast<char *>(td->_verifyPacked), chunk._bytes);
+    verifyFile.clear();
+    PIN_ReleaseLock(&verifyLock);
+    if (!ok)
+        return false;
+
+    if (chunk._count > td->_expectedCap)
+    {
+        delete[] td->_expected;
+        delete[] td->_expectedEvents;
+        td->_expected = new TRACE_RECORD[chunk._count];
+        td->_expectedEvents = new UINT32[chunk._count];
+        td->_expectedCap = chunk._count;
+    }
+    if (chunk._encoding == CHUNK_CODEC)
+        ok = CodecDecode(td->_codec, td->_verifyPacked, chunk._bytes, td->_expected, chunk._count);
+    else if ((ok = chunk._encoding == CHUNK_RAW && chunk._bytes == chunk._count * sizeof(TRACE_RECORD)))
+        memcpy(td->_expected, td->_verifyPacked, chunk._bytes);
+
+    // Whether a stamp is taken at all depends on the other threads, so
+    // stamps are left out; the verifying run takes none
+    UINT32 kept = 0;
+    for (UINT32 i = 0; ok && i < chunk._count; i++)
+    {
+        if (td->_expected[i]._kind == REC_STAMP)
+            continue;
+        td->_expected[kept] = td->_expected[i];
+        td->_expectedEvents[kept++] = i;
+    }
+    td->_verifiedEvents += td->_expectedRecords;
+    td->_verifyChunk++;
+    td->_expectedRecords = ok ? chunk._count : 0;
+    td->_expectedCount = kept;
+    td->_expectedPos = 0;
+    return ok;
+}
+
+// Whether the thread has expected records left, loading chunks as needed
+static BOOL MoreExpected(THREAD_DATA * td)
+{
+    while (td->_expectedPos == td->_expectedCount)
+    {
+        if (!NextExpected(td))
+            return false;
+    }
+    return true;
+}
+
+// Event number of the expected record at pos, or of the end of the chunk
+static inline UINT64 ExpectedEvent(const THREAD_DATA * td, UINT32 pos)
+{
+    return td->_verifiedEvents + (pos < td->_expectedCount ? td->_expectedEvents[pos] : td->_expectedRecords);
+}
+
+static BOOL RecordsMatch(const TRACE_RECORD & expected, const TRACE_RECORD & actual)
+{
+    if (memcmp(&expected, &actual, sizeof(TRACE_RECORD)) == 0)
+        return true;
+    return !KnobVerifyValues && expected._kind == REC_VALUE && actual._kind == REC_VALUE
+        && expected._ea == actual._ea && expected._size == actual._size;
+}
+
+// Advance the routine and instruction that locate the thread's events
+// past the compared records [begin, end)
+static VOID TrackContext(THREAD_DATA * td, const TRACE_RECORD * begin, const TRACE_RECORD * end)
+{
+    BOOL rtn = false;
+    BOOL ip = false;
+    for (const TRACE_RECORD * rec = end; rec > begin && !(rtn && ip); )
+    {
+        rec--;
+        if (!rtn && rec->_kind == REC_RTN_ENTER)
+        {
+            td->_verifyRtn = rec->_ip;
+            rtn = true;
+        }
+        else if (!ip && (rec->_kind == REC_READ || rec->_kind == REC_WRITE))
+        {
+            td->_verifyIp = rec->_ip;
+            ip = true;
+        }
+    }
+}
+
+static string DescribeRecord(const TRACE_RECORD & rec)
+{
+    ostringstream out;
+    out << hex;
+    switch (rec._kind)
+    {
+      case REC_READ:
+        out << "read of " << dec << rec._size << hex << " bytes at 0x" << rec._ea << " by 0x" << rec._ip;
+        break;
+      case REC_WRITE:
+        out << "write of " << dec << rec._size << hex << " bytes at 0x" << rec._ea << " by 0x" << rec._ip;
+        break;
+      case REC_VALUE:
+        out << "0x" << rec._ea << " = 0x" << rec._value;
+        break;
+      case REC_REG:
+        out << (rec._size < NUM_TRACE_GR ? TraceRegNames[rec._size] : "register ?") << " = 0x" << rec._value;
+        break;
+      case REC_VREG:
+        out << "vector register " << dec << rec._size << " byte " << rec._ea << hex << " = 0x" << rec._value;
+        break;
+      case REC_RTN_ENTER:
+        out << "enter 0x" << rec._ip;
+        break;
+      case REC_RTN_EXIT:
+        out << "exit 0x" << rec._ip;
+        break;
+      case REC_STAMP:
+        out << "stamp " << dec << rec._value;
+        break;
+      case REC_SYSCALL:
+        out << "system call " << dec << rec._size << hex << " at 0x" << rec._ip << " returning 0x" << rec._ea;
+        break;
+      case NO_RECORD:
+        out << "no more events";
+        break;
+      default:
+        out << "record of kind " << dec << rec._kind;
+        break;
+    }
+    return out.str();
+}
+
+static VOID WriteDivergence(ostream & out, const DIVERGENCE & d)
+{
+    PIN_LockClient();
+    string rtn = RTN_FindNameByAddress(d._rtn);
+    PIN_UnlockClient();
+    out << "Diverged from " << KnobVerify.Value() << " at event " << d._event << " of thread " << d._tid << endl
+        << "  in routine " << (rtn.empty() ? "?" : rtn) << " (0x" << hex << d._rtn << ")"
+        << ", after instruction 0x" << d._ip << dec << endl
+        << "  expected " << DescribeRecord(d._expected) << endl
+        << "  found    " << DescribeRecord(d._actual) << endl;
+}
+
+// Report the thread's first divergence; the process-wide first one is
+// kept for Fini. Either record may be 0 for no more events
+static VOID Diverge(THREAD_DATA * td, UINT64 event, const TRACE_RECORD * expected, const TRACE_RECORD * actual,
+                    BOOL last)
+{
+    DIVERGENCE d;
+    memset(&d, 0, sizeof(d));
+    d._found = true;
+    d._tid = td->_tid;
+    d._event = event;
+    d._rtn = td->_verifyRtn;
+    d._ip = td->_verifyIp;
+    d._expected._kind = d._actual._kind = NO_RECORD;
+    if (expected)
+        d._expected = *expected;
+    if (actual)
+        d._actual = *actual;
+    td->_verifyDone = true;
+
+    PIN_GetLock(&verifyLock, td->_tid + 1);
+    BOOL first = !divergence._found;
+    if (first)
+        divergence = d;
+    PIN_ReleaseLock(&verifyLock);
+
+    WriteDivergence(cerr, d);
+    if (first && KnobVerifyExit && !last)
+        PIN_ExitApplication(1);
+}
+
+// Compare the thread's next events against the recording. The common
+// case is one memcmp per recorded chunk; only a mismatch walks records.
+// This runs at drain time rather than in the analysis calls, so the
+// application is at most one buffer past a divergence when it is found.
+// Comparing whole records instead of a running hash or a memory
+// checksum costs nothing extra here and names the first event, routine
+// and instruction that differ, which a hash mismatch could not
+static VOID VerifyRecords(THREAD_DATA * td, const TRACE_RECORD * recs, UINT32 count, BOOL last)
+{
+    UINT32 pos = 0;
+    while (pos < count && !td->_verifyDone)
+    {
+        if (!MoreExpected(td))
+        {
+            Diverge(td, ExpectedEvent(td, td->_expectedPos), 0, &recs[pos], last);
+            return;
+        }
+
+        const TRACE_RECORD * expected = td->_expected + td->_expectedPos;
+        UINT32 n = td->_expectedCount - td->_expectedPos;
+        if (n > count - pos)
+            n = count - pos;
+        if (memcmp(expected, recs + pos, n * sizeof(TRACE_RECORD)) != 0)
+        {
+            for (UINT32 i = 0; i < n; i++)
+            {
+                if (!RecordsMatch(expected[i], recs[pos + i]))
+                {
+                    TrackContext(td, expected, expected + i);
+                    Diverge(td, ExpectedEvent(td, td->_expectedPos + i), &expected[i], &recs[pos + i], last);
+                    return;
+                }
+            }
+        }
+        TrackContext(td, expected, expected + n);
+        td->_expectedPos += n;
+        __atomic_add_fetch(&verifiedEvents, n, __ATOMIC_RELAXED);
+        pos += n;
+    }
+
+    // The recording must end where the thread does
+    if (last && !td->_verifyDone && MoreExpected(td))
+        Diverge(td, ExpectedEvent(td, td->_expectedPos), td->_expected + td->_expectedPos, 0, last);
+}
+
+// Queue the thread's buffer for writing and continue in an empty one.
+// Compression happens here so that threads do it in parallel. After the
+// last drain of a thread it has no buffer
+static VOID DrainBuffer(THREAD_DATA * td, BOOL last)
+{
+    OUT_BUFFER * out = td->_out;
+    UINT32 count = td->_cur - td->_buf;
+
+    // Verification compares the buffer in place and reuses it
+    if (verifying)
+    {
+        VerifyRecords(td, td->_buf, count, last);
+        td->_cur = td->_buf;
+        return;
+    }
+    if (count == 0)
+        return;
+
+    UINT64 start = NowUs();
+    td->_prof[PROF_DRAINS]++;
+    OUT_BUFFER * next = last ? 0 : NextBuffer(td);
+    if (!last && !next)
+    {
+        __atomic_add_fetch(&droppedChunks, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&droppedRecords, count, __ATOMIC_RELAXED);
+
+        // The buffer starts over with a REC_GAP. What the replay missed
+        // is recorded again: every register at its next capture, and
+        // every load value since the shadow forgets them
+        TRACE_RECORD * rec = td->_buf;
+        rec->_value = count;
+        rec->_ea = td->_depth;
+        rec->_size = 0;
+        rec->_kind = REC_GAP;
+        td->_cur = td->_buf + 1;
+        td->_staleRegs = ~0u;
+        td->_staleVregs = ~0ULL;
+        FreeShadow(&td->_shadow);
+        td->_prof[PROF_DRAIN_US] += NowUs() - start;
+        return;
+    }
+
+    SummaryInit(&out->_summary, td->_chunkStamp);
+    SummaryAdd(&out->_summary, out->_recs, count);
+    td->_chunkStamp = out->_summary._lastStamp;
+
+    out->_chunk._tid = td->_tid;
+    out->_chunk._count = count;
+    out->_chunk._bytes = count * sizeof(TRACE_RECORD);
+    out->_chunk._encoding = CHUNK_RAW;
+    out->_payload = out->_recs;
+    if (td->_codec)
+    {
+        size_t packed = CodecEncode(td->_codec, out->_recs, count, out->_packed);
+        if (packed != 0 && packed < out->_chunk._bytes)
+        {
+            out->_payload = out->_packed;
+            out->_chunk._bytes = packed;
+            out->_chunk._encoding = CHUNK_CODEC;
+        }
+    }
+    out->_icount = td->_icount;
+    out->_rtn = td->_rtn;
+    memcpy(out->_regs, td->_regval, sizeof(out->_regs));
+    if (numVregs)
+        memcpy(out->_vregs, td->_vregval, sizeof(out->_vregs));
+    out->_depth = td->_depth;
+    td->_prof[PROF_QUEUED_BYTES] += out->_chunk._bytes;
+
+    PushBuffer(&writeQueue, out);
+    if (writerRunning)
+        PIN_SemaphoreSet(&writerSem);
+    else
+        WriteQueued(td->_tid);
+
+    td->_out = next;
+    td->_buf = next ? next->_recs : 0;
+    td->_cur = td->_buf;
+    td->_end = next ? td->_buf + KnobBufferRecords.Value() : 0;
+    td->_prof[PROF_DRAIN_US] += NowUs() - start;
+}
+
+
+/////////////////////
+// ANALYSIS FUNCTIONS
+/////////////////////
+
+
+static inline UINT64 ReadTsc()
+{
+    UINT32 lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+// A stamp later than the thread's last one and, with the logical clock,
+// than the clock value seen
+static inline UINT64 NextStamp(THREAD_DATA * td, UINT64 seen)
+{
+    if (stampClock == STAMP_TSC)
+        return ReadTsc();
+    td->_clock = (seen > td->_clock ? seen : td->_clock) + 1;
+    return td->_clock;
+}
+
+// Where the thread next has to stop appending records
+static inline VOID SetLimit(THREAD_DATA * td)
+{
+    td->_limit = td->_end;
+    if (stampEvents && td->_cur && (UINT64)(td->_end - td->_cur) > stampEvents)
+        td->_limit = td->_cur + stampEvents;
+}
+
+// The thread reached _limit: take the periodic stamp if that is what is
+// due, and drain the buffer if it is full
+static VOID RecordLimit(THREAD_DATA * td)
+{
+    if (td->_cur < td->_end)
+    {
+        TRACE_RECORD * rec = td->_cur++;
+        rec->_value = NextStamp(td, 0);
+        rec->_ea = 0;
+        rec->_size = 0;
+        rec->_kind = REC_STAMP;
+    }
+    if (td->_cur == td->_end)
+        DrainBuffer(td, false);
+    SetLimit(td);
+}
+
+static inline VOID AppendRecord(THREAD_DATA * td, ADDRINT ip, ADDRINT addr, UINT32 size, UINT32 kind)
+{
+    TRACE_RECORD * rec = td->_cur;
+    rec->_ip = ip;
+    rec->_ea = addr;
+    rec->_size = size;
+    rec->_kind = kind;
+    if (++td->_cur == td->_limit)
+        RecordLimit(td);
+}
+
+// Stamp a synchronization point; the periodic stamp restarts from here
+static VOID AppendStamp(THREAD_DATA * td, UINT64 seen)
+{
+    if (stampClock == STAMP_NONE)
+        return;
+    AppendRecord(td, NextStamp(td, seen), 0, 0, REC_STAMP);
+    SetLimit(td);
+}
+
+static inline UINT64 SlotOwner(THREAD_DATA * td)
+{
+    return (td->_tid + 1) & 0xffff;
+}
+
+static inline volatile UINT64 * SyncClock(ADDRINT addr)
+{
+    return &syncClocks[(addr >> 6) & (SYNC_CLOCKS - 1)]._clock;
+}
+
+// The thread may be about to let another one go: whatever it recorded
+// so far must come before the other thread's next stamp. The logical
+// clock raises the slot to the thread's clock without a record, the
+// time stamp counter takes a stamp
+static inline VOID ReleaseClock(THREAD_DATA * td, volatile UINT64 * slot)
+{
+    if (stampClock == STAMP_TSC)
+    {
+        AppendStamp(td, 0);
+        return;
+    }
+    UINT64 mine = td->_clock << 16 | SlotOwner(td);
+    UINT64 seen = *slot;
+    while (seen != mine && seen >> 16 <= td->_clock &&
+           !__atomic_compare_exchange_n(slot, &seen, mine, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+// The thread may have waited for another: stamp it past what was
+// published to the slot, unless its clock already is or it published it
+static inline VOID AcquireClock(THREAD_DATA * td, volatile UINT64 * slot)
+{
+    if (stampClock == STAMP_TSC)
+    {
+        AppendStamp(td, 0);
+        return;
+    }
+    UINT64 seen = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (seen >> 16 >= td->_clock && (seen & 0xffff) != SlotOwner(td))
+        AppendStamp(td, seen >> 16);
+}
+
+// Hold a record back for FlushLoads, or append it if there is no room.
+// Records another instruction held are of one that faulted before it
+// loaded, and are dropped
+static inline VOID HoldRecord(THREAD_DATA * td, ADDRINT ip, ADDRINT addr, UINT32 size, UINT32 kind)
+{
+    if (td->_numHeld && td->_held[0]._ip != ip)
+        td->_numHeld = 0;
+    if (td->_numHeld == MAX_HELD)
+    {
+        AppendRecord(td, ip, addr, size, kind);
+        return;
+    }
+    TRACE_RECORD * rec = &td->_held[td->_numHeld++];
+    rec->_ip = ip;
+    rec->_ea = addr;
+    rec->_size = size;
+    rec->_kind = kind;
+}
+
+// After a load with the logical clock, see SyncClock. A store the load
+// saw can have published its clock after IPOINT_BEFORE, so the load's
+// REC_READ waits until here to be stamped past it
+static VOID FlushLoads(THREADID tid)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_STAMP_CALLS]++;
+    for (UINT32 i = 0; i < td->_numHeld; i++)
+    {
+        if (td->_held[i]._kind == REC_READ)
+            AcquireClock(td, SyncClock(td->_held[i]._ea));
+    }
+    for (UINT32 i = 0; i < td->_numHeld; i++)
+    {
+        const TRACE_RECORD * rec = &td->_held[i];
+        AppendRecord(td, rec->_ip, rec->_ea, rec->_size, rec->_kind);
+    }
+    td->_numHeld = 0;
+}
+
+// Around an atomic read-modify-write with the time stamp counter, which
+// takes the place of the loads and stores the logical clock syncs at
+static VOID StampAtomic(THREADID tid)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_STAMP_CALLS]++;
+    AppendStamp(td, 0);
+}
+
+// Whether the shadow knows all of [addr, addr + size) and it holds the low
+// size bytes of value
+static BOOL ShadowMatches(SHADOW_MEMORY * sm, ADDRINT addr, UINT64 value, UINT32 size)
+{
+    const UINT8 * bytes = reinterpret_cast<const UINT8 *>(&value);
+    for (UINT32 i = 0; i < size; i++)
+    {
+        const SHADOW_PAGE * p = ShadowFind(sm, addr + i, false);
+        UINT32 off = (addr + i) % SHADOW_PAGE_SIZE;
+        if (!p || !(p->_known[off / 8] & (1 << (off % 8))) || p->_data[off] != bytes[i])
+            return false;
+    }
+    return true;
+}
+
+static VOID ShadowUpdate(SHADOW_MEMORY * sm, ADDRINT addr, UINT64 value, UINT32 size)
+{
+    const UINT8 * bytes = reinterpret_cast<const UINT8 *>(&value);
+    for (UINT32 i = 0; i < size; i++)
+    {
+        SHADOW_PAGE * p = ShadowFind(sm, addr + i, true);
+        UINT32 off = (addr + i) % SHADOW_PAGE_SIZE;
+        p->_data[off] = bytes[i];
+        p->_known[off / 8] |= 1 << (off % 8);
+    }
+}
+
+// Append a REC_VALUE, keeping the thread's shadow in step with its records
+static inline VOID AppendValue(THREAD_DATA * td, ADDRINT addr, UINT64 value, UINT32 size)
+{
+    if (loadValues)
+        ShadowUpdate(&td->_shadow, addr, value, size);
+    AppendRecord(td, value, addr, size, REC_VALUE);
+}
+
+// Record a memory read
+static VOID RecordMemRead(THREADID tid, ADDRINT ip, ADDRINT addr, UINT32 size)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_READ_CALLS]++;
+    AppendRecord(td, ip, addr, size, REC_READ);
+}
+
+// Record a memory read with the logical clock, once it has read
+static VOID HoldMemRead(THREADID tid, ADDRINT ip, ADDRINT addr, UINT32 size)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_READ_CALLS]++;
+    HoldRecord(td, ip, addr, size, REC_READ);
+}
+
+// Record a memory read and, eight bytes per REC_VALUE ahead of it, the
+// data it reads that the thread's earlier values do not predict. The
+// records say the load saw the data as copied here, so the logical clock
+// syncs after each copy, and a store that published later is not one the
+// recording saw
+static VOID RecordMemReadValue(THREADID tid, ADDRINT ip, ADDRINT addr, UINT32 size)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_READ_CALLS]++;
+    for (UINT32 off = 0; off < size; off += sizeof(UINT64))
+    {
+        UINT32 n = size - off < sizeof(UINT64) ? size - off : sizeof(UINT64);
+        UINT64 value = 0;
+        if (PIN_SafeCopy(&value, reinterpret_cast<VOID *>(addr + off), n) != n)
+            break;
+        if (stampClock == STAMP_LOGICAL)
+            AcquireClock(td, SyncClock(addr + off));
+        if (ShadowMatches(&td->_shadow, addr + off, value, n))
+        {
+            td->_prof[PROF_ELIDED_VALUES]++;
+            continue;
+        }
+        td->_prof[PROF_LOAD_VALUES]++;
+        AppendValue(td, addr + off, value, n);
+    }
+    AppendRecord(td, ip, addr, size, REC_READ);
+}
+
+// Record a memory write. The data is only there once the instruction
+// has executed, so remember where to pick it up. Any store may release
+// a lock or a flag, so it publishes the logical clock
+static VOID RecordMemWrite(THREADID tid, ADDRINT ip, ADDRINT addr, UINT32 size)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_WRITE_CALLS]++;
+    td->_writeEa = addr;
+    td->_writeSize = size;
+    if (stampClock != STAMP_LOGICAL)
+    {
+        AppendRecord(td, ip, addr, size, REC_WRITE);
+        return;
+    }
+    ReleaseClock(td, SyncClock(addr));
+    // Behind the instruction's held loads, as without the logical clock
+    if (td->_numHeld && td->_held[0]._ip == ip)
+        HoldRecord(td, ip, addr, size, REC_WRITE);
+    else
+        AppendRecord(td, ip, addr, size, REC_WRITE);
+}
+
+// Record the data of the last store, eight bytes per record
+static VOID RecordWriteValue(THREADID tid)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_VALUE_CALLS]++;
+    for (UINT32 off = 0; off < td->_writeSize; off += sizeof(UINT64))
+    {
+        UINT32 size = td->_writeSize - off < sizeof(UINT64) ? td->_writeSize - off : sizeof(UINT64);
+        UINT64 value = 0;
+        PIN_SafeCopy(&value, reinterpret_cast<VOID *>(td->_writeEa + off), size);
+        AppendValue(td, td->_writeEa + off, value, size);
+    }
+}
+
+
+// Record the registers in mask whose value differs from base or from
+// what the recording last said about them. vals holds them in the order
+// of their GR_BIT
+static VOID RecordRegisterValues(THREAD_DATA * td, UINT32 mask, const ADDRINT * vals, const ADDRINT * base)
+{
+    td->_prof[PROF_REG_CALLS]++;
+    for (UINT32 idx = 0; mask; idx++, mask >>= 1)
+    {
+        if (!(mask & 1))
+            continue;
+        ADDRINT val = *vals++;
+        if (val != td->_regval[idx] || val != base[idx] || (td->_staleRegs & (1u << idx)))
+        {
+            td->_staleRegs &= ~(1u << idx);
+            td->_regval[idx] = val;
+            AppendRecord(td, val, 0, idx, REC_REG);
+        }
+    }
+}
+
+// Entry registers of the routine BeforeRoutine just pushed, the ones the
+// routine can write, and the snapshot its exit is compared against
+VOID PIN_FAST_ANALYSIS_CALL RecordEntryRegisters(THREAD_DATA * td, UINT32 mask,
+    ADDRINT r0, ADDRINT r1, ADDRINT r2, ADDRINT r3, ADDRINT r4, ADDRINT r5, ADDRINT r6, ADDRINT r7,
+    ADDRINT r8, ADDRINT r9, ADDRINT r10, ADDRINT r11, ADDRINT r12, ADDRINT r13, ADDRINT r14, ADDRINT r15)
+{
+    const ADDRINT vals[NUM_GR] = { r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15 };
+    RecordRegisterValues(td, mask, vals, td->_regval);
+    if (td->_depth > 0)
+        memcpy(td->_stack[td->_depth - 1]._regs, td->_regval, sizeof(td->_regval));
+}
+
+// Exit registers at a return, each one that changed since the routine's
+// entry even if a callee already recorded the new value
+VOID PIN_FAST_ANALYSIS_CALL RecordExitRegisters(THREAD_DATA * td, UINT32 mask,
+    ADDRINT r0, ADDRINT r1, ADDRINT r2, ADDRINT r3, ADDRINT r4, ADDRINT r5, ADDRINT r6, ADDRINT r7,
+    ADDRINT r8, ADDRINT r9, ADDRINT r10, ADDRINT r11, ADDRINT r12, ADDRINT r13, ADDRINT r14, ADDRINT r15)
+{
+    const ADDRINT vals[NUM_GR] = { r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15 };
+    RecordRegisterValues(td, mask, vals, td->_depth > 0 ? td->_stack[td->_depth - 1]._regs : td->_regval);
+}
+
+// Bit q set for every quadword q of the 'bytes' bytes at a and b that
+// differs. Whole 16 byte lanes are compared at a time
+static inline UINT32 ChangedQuadwords(const UINT8 * a, const UINT8 * b, UINT32 bytes)
+{
+    UINT64 equal = 0;
+    for (UINT32 off = 0; off < bytes; off += 16)
+    {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + off)),
+                                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + off)));
+        equal |= (UINT64)(UINT32)_mm_movemask_epi8(eq) << off;
+    }
+    UINT32 changed = 0;
+    for (UINT32 q = 0; q < bytes / 8; q++)
+    {
+        if (((equal >> (q * 8)) & 0xff) != 0xff)
+            changed |= 1 << q;
+    }
+    return changed;
+}
+
+// The register captured as TRACE_VREG number idx, at the recorded width
+static REG VectorReg(UINT32 idx)
+{
+    if (idx >= TRACE_VREG_K0)
+        return (REG)(REG_K_BASE + idx - TRACE_VREG_K0);
+    if (vregBytes == 64)
+        return (REG)(REG_ZMM_BASE + idx);
+    if (vregBytes == 32)
+        return (REG)(REG_YMM_BASE + idx);
+    return (REG)(REG_XMM_BASE + idx);
+}
+
+// Record the quadwords of the vector registers in mask, those the routine
+// can write, that differ from what the recording last said about them.
+// One call per site reads them all from a partial CONTEXT of just those
+static VOID RecordVectorRegisters(THREADID tid, UINT64 mask, const CONTEXT * ctxt)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_VREG_CALLS]++;
+    td->_prof[PROF_CONTEXTS]++;
+    PIN_REGISTER val;
+    for (UINT32 idx = 0; mask; idx++, mask >>= 1)
+    {
+        if (!(mask & 1))
+            continue;
+        PIN_GetContextRegval(ctxt, VectorReg(idx), val.byte);
+        UINT8 * old = td->_vregval[idx];
+        UINT32 changed;
+        if (td->_staleVregs & VREG_BIT(idx))
+            changed = idx >= TRACE_VREG_K0 ? 1 : (1u << vregBytes / 8) - 1;
+        else if (idx >= TRACE_VREG_K0)
+            changed = memcmp(old, val.byte, sizeof(UINT64)) != 0;
+        else
+            changed = ChangedQuadwords(old, val.byte, vregBytes);
+        td->_staleVregs &= ~VREG_BIT(idx);
+        for (UINT32 q = 0; changed; q++, changed >>= 1)
+        {
+            if (!(changed & 1))
+                continue;
+            memcpy(old + q * 8, val.byte + q * 8, sizeof(UINT64));
+            AppendRecord(td, val.qword[q], q * 8, idx, REC_VREG);
+        }
+    }
+}
+
+
+/* ===================================================================== */
+// System calls
+/* ===================================================================== */
+
+// Kernel output buffers of a fixed size: the system call, the argument
+// pointing to the buffer, and its size in the x86-64 ABI
+typedef struct SyscallOutput
+{
+    ADDRINT _num;
+    UINT32 _arg;
+    UINT32 _size;
+} SYSCALL_OUTPUT;
+
+static const SYSCALL_OUTPUT FixedOutputs[] =
+{
+    { SYS_stat, 1, 144 },
+    { SYS_fstat, 1, 144 },
+    { SYS_lstat, 1, 144 },
+    { SYS_newfstatat, 2, 144 },
+    { SYS_statx, 4, 256 },
+    { SYS_statfs, 1, 120 },
+    { SYS_fstatfs, 1, 120 },
+    { SYS_clock_gettime, 1, 16 },
+    { SYS_clock_getres, 1, 16 },
+    { SYS_gettimeofday, 0, 16 },
+    { SYS_gettimeofday, 1, 8 },
+    { SYS_time, 0, 8 },
+    { SYS_uname, 0, 390 },
+    { SYS_sysinfo, 0, 112 },
+    { SYS_times, 0, 32 },
+    { SYS_getrusage, 1, 144 },
+    { SYS_wait4, 1, 4 },
+    { SYS_wait4, 3, 144 },
+    { SYS_pipe, 0, 8 },
+    { SYS_pipe2, 0, 8 },
+    { SYS_socketpair, 3, 8 },
+    { SYS_getrlimit, 1, 16 },
+    { SYS_prlimit64, 3, 16 },
+    { SYS_getitimer, 1, 32 },
+    { SYS_rt_sigaction, 2, 32 },
+    { SYS_getresuid, 0, 4 },
+    { SYS_getresuid, 1, 4 },
+    { SYS_getresuid, 2, 4 },
+    { SYS_getresgid, 0, 4 },
+    { SYS_getresgid, 1, 4 },
+    { SYS_getresgid, 2, 4 },
+    { SYS_getcpu, 0, 4 },
+    { SYS_getcpu, 1, 4 }
+};
+
+// Up to eight bytes of user memory, zero where it cannot be read
+static ADDRINT ReadUser(ADDRINT addr, UINT32 size)
+{
+    ADDRINT value = 0;
+    PIN_SafeCopy(&value, reinterpret_cast<VOID *>(addr), size);
+    return value;
+}
+
+// Record that the kernel wrote [addr, addr + size), as a store by the
+// syscall instruction. The data is copied from user memory straight into
+// the record buffer
+static VOID RecordKernelWrite(THREAD_DATA * td, ADDRINT addr, UINT64 size)
+{
+    if (addr == 0 || size == 0)
+        return;
+    if (size > 0xffffffffu)
+        size = 0xffffffffu;
+    AppendRecord(td, td->_sysIp, addr, (UINT32)size, REC_WRITE);
+    for (UINT64 off = 0; off < size; off += sizeof(UINT64))
+    {
+        TRACE_RECORD * rec = td->_cur;
+        rec->_value = 0;
+        rec->_size = size - off < sizeof(UINT64) ? size - off : sizeof(UINT64);
+        PIN_SafeCopy(&rec->_value, reinterpret_cast<VOID *>(addr + off), rec->_size);
+        rec->_ea = addr + off;
+        rec->_kind = REC_VALUE;
+        if (loadValues)
+            ShadowUpdate(&td->_shadow, rec->_ea, rec->_value, rec->_size);
+        if (++td->_cur == td->_limit)
+            RecordLimit(td);
+    }
+}
+
+// The first 'total' bytes scattered over an array of count iovecs
+static VOID RecordKernelIov(THREAD_DATA * td, ADDRINT iov, UINT64 count, UINT64 total)
+{
+    for (UINT64 i = 0; i < count && total > 0; i++)
+    {
+        ADDRINT base = ReadUser(iov + 16 * i, 8);
+        UINT64 len = ReadUser(iov + 16 * i + 8, 8);
+        if (len > total)
+            len = total;
+        RecordKernelWrite(td, base, len);
+        total -= len;
+    }
+}
+
+// A socket address whose length the kernel stored at lenAddr
+static VOID RecordKernelSockaddr(THREAD_DATA * td, ADDRINT addr, ADDRINT lenAddr)
+{
+    if (addr == 0 || lenAddr == 0)
+        return;
+    RecordKernelWrite(td, lenAddr, 4);
+    RecordKernelWrite(td, addr, ReadUser(lenAddr, 4));
+}
+
+// Everything the successful system call in flight wrote to user memory
+// that this tool knows of. Calls that are not listed only get their
+// REC_SYSCALL
+static VOID RecordKernelWrites(THREAD_DATA * td, ADDRINT ret)
+{
+    const ADDRINT * arg = td->_sysArgs;
+    for (UINT32 i = 0; i < sizeof(FixedOutputs) / sizeof(FixedOutputs[0]); i++)
+    {
+        if (FixedOutputs[i]._num == td->_sysNum)
+            RecordKernelWrite(td, arg[FixedOutputs[i]._arg], FixedOutputs[i]._size);
+    }
+
+    switch (td->_sysNum)
+    {
+      case SYS_read:
+      case SYS_pread64:
+      case SYS_getdents64:
+      case SYS_readlink:
+        RecordKernelWrite(td, arg[1], ret);
+        break;
+      case SYS_readlinkat:
+      case SYS_sched_getaffinity:
+        RecordKernelWrite(td, arg[2], ret);
+        break;
+      case SYS_getrandom:
+      case SYS_getcwd:
+        RecordKernelWrite(td, arg[0], ret);
+        break;
+      case SYS_readv:
+      case SYS_preadv:
+      case SYS_preadv2:
+        RecordKernelIov(td, arg[1], arg[2], ret);
+        break;
+      case SYS_recvfrom:
+        RecordKernelWrite(td, arg[1], ret);
+        RecordKernelSockaddr(td, arg[4], arg[5]);
+        break;
+      case SYS_recvmsg:
+      {
+        // struct msghdr: name, namelen, iov, iovlen, control, controllen, flags
+        ADDRINT msg = arg[1];
+        RecordKernelWrite(td, msg, 56);
+        RecordKernelWrite(td, ReadUser(msg, 8), ReadUser(msg + 8, 4));
+        RecordKernelIov(td, ReadUser(msg + 16, 8), ReadUser(msg + 24, 8), ret);
+        RecordKernelWrite(td, ReadUser(msg + 32, 8), ReadUser(msg + 40, 8));
+        break;
+      }
+      case SYS_accept:
+      case SYS_accept4:
+      case SYS_getsockname:
+      case SYS_getpeername:
+        RecordKernelSockaddr(td, arg[1], arg[2]);
+        break;
+      case SYS_getsockopt:
+        RecordKernelSockaddr(td, arg[3], arg[4]);
+        break;
+      case SYS_epoll_wait:
+      case SYS_epoll_pwait:
+        RecordKernelWrite(td, arg[1], ret * 12);
+        break;
+      case SYS_poll:
+      case SYS_ppoll:
+        RecordKernelWrite(td, arg[0], arg[1] * 8);
+        break;
+      case SYS_select:
+      case SYS_pselect6:
+        for (UINT32 set = 1; set <= 3; set++)
+            RecordKernelWrite(td, arg[set], (arg[0] + 63) / 64 * 8);
+        // The time left, a timeval for select and a timespec for pselect6
+        RecordKernelWrite(td, arg[4], 16);
+        break;
+      case SYS_rt_sigprocmask:
+        RecordKernelWrite(td, arg[2], arg[3]);
+        break;
+      default:
+        break;
+    }
+}
+
+// Whether events the tool generates itself, rather than instrumentation,
+// go into the thread's records now
+static BOOL EventsRecorded(THREAD_DATA * td)
+{
+    return recording && td->_buf && !footprint && !cacheSim && (!gated || td->_gate);
+}
+
+// A system call may wait for, or release, another thread, so it is
+// stamped on both sides
+VOID SyscallEntry(THREADID tid, CONTEXT * ctxt, SYSCALL_STANDARD std, VOID * v)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_SYSCALL_CALLS]++;
+    td->_prof[PROF_CONTEXTS]++;
+    td->_sysIp = PIN_GetContextReg(ctxt, REG_INST_PTR);
+    td->_sysNum = PIN_GetSyscallNumber(ctxt, std);
+    for (UINT32 i = 0; i < 6; i++)
+        td->_sysArgs[i] = PIN_GetSyscallArgument(ctxt, std, i);
+    if (EventsRecorded(td))
+        ReleaseClock(td, &kernelClock);
+}
+
+// Log the result of the system call, and what it wrote unless it failed
+VOID SyscallExit(THREADID tid, CONTEXT * ctxt, SYSCALL_STANDARD std, VOID * v)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_CONTEXTS]++;
+    if (!EventsRecorded(td))
+        return;
+    ADDRINT ret = PIN_GetSyscallReturn(ctxt, std);
+    AcquireClock(td, &kernelClock);
+    AppendRecord(td, td->_sysIp, ret, (UINT32)td->_sysNum, REC_SYSCALL);
+    if (ret < (ADDRINT)-4095)
+        RecordKernelWrites(td, ret);
+}
+
+// System calls the vDSO answers in user space, under its own name or the
+// alias it also exports. Their outputs are the system call's, so
+// FixedOutputs describes them
+typedef struct VdsoCall
+{
+    const char * _name;
+    const char * _alias;
+    ADDRINT _num;
+} VDSO_CALL;
+
+static const VDSO_CALL VdsoCalls[] =
+{
+    { "__vdso_clock_gettime", "clock_gettime", SYS_clock_gettime },
+    { "__vdso_clock_getres", "clock_getres", SYS_clock_getres },
+    { "__vdso_gettimeofday", "gettimeofday", SYS_gettimeofday },
+    { "__vdso_time", "time", SYS_time },
+    { "__vdso_getcpu", "getcpu", SYS_getcpu }
+};
+
+VOID VdsoEntry(THREADID tid, ADDRINT ip, ADDRINT num, ADDRINT arg0, ADDRINT arg1)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_SYSCALL_CALLS]++;
+    td->_vdsoIp = ip;
+    td->_vdsoNum = num;
+    td->_vdsoArgs[0] = arg0;
+    td->_vdsoArgs[1] = arg1;
+}
+
+// Log the call as the system call it stands for, made at the vDSO
+// routine. A fallback to the real system call inside it is logged too
+VOID VdsoExit(THREADID tid, ADDRINT ret)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    if (!EventsRecorded(td))
+        return;
+    td->_sysIp = td->_vdsoIp;
+    td->_sysNum = td->_vdsoNum;
+    td->_sysArgs[0] = td->_vdsoArgs[0];
+    td->_sysArgs[1] = td->_vdsoArgs[1];
+    AppendRecord(td, td->_sysIp, ret, (UINT32)td->_sysNum, REC_SYSCALL);
+    if (ret < (ADDRINT)-4095)
+        RecordKernelWrites(td, ret);
+}
+
+// Pin calls this function for every image loaded; only the vDSO is
+// instrumented, see VdsoCalls
+VOID ImageLoad(IMG img, VOID * v)
+{
+    if (!IMG_IsVDSO(img))
+        return;
+    for (UINT32 i = 0; i < sizeof(VdsoCalls) / sizeof(VdsoCalls[0]); i++)
+    {
+        RTN rtn = RTN_FindByName(img, VdsoCalls[i]._name);
+        if (!RTN_Valid(rtn))
+            rtn = RTN_FindByName(img, VdsoCalls[i]._alias);
+        if (!RTN_Valid(rtn))
+            continue;
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)VdsoEntry, IARG_THREAD_ID, IARG_ADDRINT, RTN_Address(rtn),
+                       IARG_ADDRINT, VdsoCalls[i]._num, IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)VdsoExit, IARG_THREAD_ID, IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
+        RTN_Close(rtn);
+    }
+}
+
+
+static CCT_NODE * NewCctNode(UINT32 rtn, CCT_NODE * parent)
+{
+    CCT_NODE * node = new CCT_NODE;
+    memset(node, 0, sizeof(*node));
+    node->_rtn = rtn;
+    node->_parent = parent;
+    return node;
+}
+
+// The child of parent for routine rtn, created if needed and moved to
+// the front of the list
+static CCT_NODE * CctChild(CCT_NODE * parent, UINT32 rtn)
+{
+    CCT_NODE ** link = &parent->_child;
+    while (*link && (*link)->_rtn != rtn)
+        link = &(*link)->_sibling;
+    CCT_NODE * node = *link;
+    if (node)
+        *link = node->_sibling;
+    else
+        node = NewCctNode(rtn, parent);
+    node->_sibling = parent->_child;
+    parent->_child = node;
+    return node;
+}
+
+// Leave every frame whose return address is at or below sp: the one a
+// ret at sp returns from, and frames a tail call, longjmp or exception
+// left without a ret of their own
+static VOID PopFrames(THREAD_DATA * td, ADDRINT sp)
+{
+    while (td->_depth > 0 && td->_stack[td->_depth - 1]._sp <= sp)
+    {
+        const FRAME & frame = td->_stack[--td->_depth];
+        td->_ctx = frame._caller;
+        AppendRecord(td, frame._rtn, 0, 0, REC_RTN_EXIT);
+    }
+}
+
+// The REC_REG records right after the routine's REC_RTN_ENTER are its
+// entry registers, those right before its REC_RTN_EXIT its exit registers;
+// offline/TraceDump.cpp prints the difference
+VOID BeforeRoutine(THREADID tid, UINT32 id, ADDRINT address, ADDRINT sp)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_ENTER_CALLS]++;
+    PopFrames(td, sp);
+    if (td->_depth == td->_stackCap)
+    {
+        UINT32 cap = td->_stackCap ? td->_stackCap * 2 : 256;
+        FRAME * stack = new FRAME[cap];
+        memcpy(stack, td->_stack, td->_depth * sizeof(FRAME));
+        delete[] td->_stack;
+        td->_stack = stack;
+        td->_stackCap = cap;
+    }
+    FRAME * frame = &td->_stack[td->_depth++];
+    frame->_rtn = address;
+    frame->_sp = sp;
+    frame->_caller = td->_ctx;
+    if (cct)
+    {
+        td->_ctx = CctChild(td->_ctx, id);
+        td->_ctx->_calls++;
+    }
+    td->_rtn = address;
+    AppendRecord(td, address, 0, 0, REC_RTN_ENTER);
+}
+
+// Called at every return instruction of an instrumented routine
+VOID AfterRoutine(THREADID tid, ADDRINT sp)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    td->_prof[PROF_RETURN_CALLS]++;
+    PopFrames(td, sp);
+}
+
+// Switch between full recording and the ROI-less instrumentation. The
+// code cache is flushed so that Routine() instruments everything again.
+// Called with roiLock held
+static VOID SetRecording(BOOL on)
+{
+    // A -bbv run never records
+    if (bbvFile.is_open())
+        return;
+    if (recording != on)
+    {
+        recording = on;
+        PIN_RemoveInstrumentation();
+    }
+}
+
+VOID StartRoi(THREADID tid)
+{
+    PIN_GetLock(&roiLock, tid + 1);
+    SetRecording(true);
+    PIN_ReleaseLock(&roiLock);
+}
+
+VOID StopRoi(THREADID tid)
+{
+    PIN_GetLock(&roiLock, tid + 1);
+    SetRecording(false);
+    PIN_ReleaseLock(&roiLock);
+}
+
+// -roi_rtn can recurse and the -simpoints of different threads can
+// overlap, only the outermost one starts and stops the ROI
+VOID EnterRoi(THREADID tid)
+{
+    PIN_GetLock(&roiLock, tid + 1);
+    if (roiDepth++ == 0)
+        SetRecording(true);
+    PIN_ReleaseLock(&roiLock);
+}
+
+VOID ExitRoi(THREADID tid)
+{
+    PIN_GetLock(&roiLock, tid + 1);
+    if (roiDepth > 0 && --roiDepth == 0)
+        SetRecording(false);
+    PIN_ReleaseLock(&roiLock);
+}
+
+// Inlined countdown for -skip, the Then call starts the ROI. Threads
+// racing on the counter can only make the ROI start a little late
+ADDRINT PIN_FAST_ANALYSIS_CALL SkipCountdown(UINT32 numIns)
+{
+    skipLeft -= numIns;
+    return skipLeft <= 0;
+}
+
+// Sampling. The If part runs before every basic block and is all that
+// runs outside a burst
+ADDRINT PIN_FAST_ANALYSIS_CALL SampleTick(THREAD_DATA * td, UINT32 numIns)
+{
+    td->_sampleLeft -= numIns;
+    return (td->_sampleLeft <= 0) | td->_inBurst;
+}
+
+// Guards every recording call while gated
+ADDRINT PIN_FAST_ANALYSIS_CALL Gate(THREAD_DATA * td)
+{
+    return td->_gate;
+}
+
+static inline VOID UpdateGate(THREAD_DATA * td)
+{
+    td->_gate = td->_inBurst && (SimPoints.empty() || td->_inSimPoint);
+}
+
+// End the current period. The block of numIns instructions that ran out
+// the countdown belongs to the next one
+static VOID SwitchBurst(THREAD_DATA * td, UINT32 numIns)
+{
+    INT64 elapsed = td->_samplePeriod - (td->_sampleLeft + numIns);
+    td->_totalIns += elapsed;
+    if (td->_inBurst)
+        td->_sampledIns += elapsed;
+
+    INT64 period = KnobSampleBurst.Value();
+    if (td->_inBurst)
+    {
+        // With -sample_ms the gap is polled once per burst length
+        td->_inBurst = 0;
+        if (KnobSampleMs.Value())
+            td->_nextBurstMs = NowMs() + KnobSampleMs.Value();
+        else
+            period = KnobSamplePeriod.Value() - KnobSampleBurst.Value();
+    }
+    else if (!KnobSampleMs.Value() || NowMs() >= td->_nextBurstMs)
+    {
+        td->_inBurst = 1;
+    }
+    UpdateGate(td);
+    td->_samplePeriod = period;
+    td->_sampleLeft = period - numIns;
+}
+
+// Then part of SampleTick: switch periods if the countdown ran out and
+// count the block if it is in a burst
+VOID PIN_FAST_ANALYSIS_CALL SampleBbl(THREAD_DATA * td, UINT32 id, UINT32 numIns, UINT32 numMem)
+{
+    if (td->_sampleLeft <= 0)
+        SwitchBurst(td, numIns);
+    if (!td->_gate)
+        return;
+
+    td->_icount = td->_totalIns + td->_samplePeriod - td->_sampleLeft;
+    if (KnobCount.Value())
+    {
+        UINT64 * counters = RtnCounters(td, id);
+        counters[CNT_ICOUNT] += numIns;
+        counters[CNT_MEMACC] += numMem;
+    }
+    if (cct)
+    {
+        td->_ctx->_icount += numIns;
+        td->_ctx->_memacc += numMem;
+    }
+}
+
+// Intervals. The If part runs before every basic block
+ADDRINT PIN_FAST_ANALYSIS_CALL IntervalTick(THREAD_DATA * td, UINT32 numIns)
+{
+    td->_intervalLeft -= numIns;
+    return td->_intervalLeft <= 0;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL CountBbv(THREAD_DATA * td, UINT32 id, UINT32 numIns)
+{
+    td->_prof[PROF_BBV_CALLS]++;
+    td->_bbv[id / BBV_BLOCK_BBLS][id % BBV_BLOCK_BBLS] += numIns;
+}
+
+// Write the vector of the interval that just ended as one line,
+// "tid interval instructions :id:count :id:count ...", and clear it
+static VOID WriteBbv(THREAD_DATA * td, UINT64 instructions)
+{
+    if (instructions == 0)
+        return;
+    PIN_GetLock(&bbvLock, td->_tid + 1);
+    bbvFile << td->_tid << " " << td->_interval << " " << instructions;
+    for (UINT32 b = 0; b < MAX_BBV_BLOCKS && td->_bbv[b]; b++)
+    {
+        for (UINT32 i = 0; i < BBV_BLOCK_BBLS; i++)
+        {
+            if (td->_bbv[b][i] == 0)
+                continue;
+            bbvFile << " :" << b * BBV_BLOCK_BBLS + i << ":" << td->_bbv[b][i];
+            td->_bbv[b][i] = 0;
+        }
+    }
+    bbvFile << "\n";
+    PIN_ReleaseLock(&bbvLock);
+}
+
+// Start or stop recording the thread when it enters or leaves one of its
+// -simpoints intervals. The ROI only keeps the instrumentation in place
+// while any thread is in one; the gate decides which threads record
+static VOID CheckSimPoint(THREAD_DATA * td)
+{
+    BOOL selected = SimPoints.count(make_pair((UINT32)td->_tid, td->_interval)) > 0;
+    if (selected == td->_inSimPoint)
+        return;
+    td->_inSimPoint = selected;
+    UpdateGate(td);
+    if (selected)
+        EnterRoi(td->_tid);
+    else
+        ExitRoi(td->_tid);
+}
+
+// Then part of IntervalTick. Whatever the last block ran over the
+// interval is taken from the next one, so boundaries stay put
+VOID EndInterval(THREADID tid)
+{
+    THREAD_DATA * td = GetThreadData(tid);
+    if (bbvFile.is_open())
+        WriteBbv(td, KnobInterval.Value() - td->_intervalLeft);
+    td->_interval++;
+    td->_intervalLeft += KnobInterval.Value();
+    if (!SimPoints.empty())
+        CheckSimPoint(td);
+}
+
+// A jump out of rtn, usually a tail call. Indirect jumps may be one
+static BOOL LeavesRoutine(RTN rtn, INS ins)
+{
+    if (!INS_IsBranch(ins))
+        return false;
+    if (!INS_IsDirectControlFlow(ins))
+        return true;
+    ADDRINT target = INS_DirectControlFlowTargetAddress(ins);
+    return target < RTN_Address(rtn) || target >= RTN_Address(rtn) + RTN_Size(rtn);
+}
+
+// The general purpose registers, as a GR_BIT mask, whose value can differ
+// between the routine's entry and its last instruction. Only these are
+// captured, which is what makes full CONTEXT materialization unnecessary
+static UINT32 RoutineWrittenRegs(RTN rtn)
+{
+    UINT32 mask = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); i++)
+        {
+            REG reg = REG_FullRegName(INS_RegW(ins, i));
+            if (reg >= REG_GR_BASE && reg <= REG_GR_LAST)
+                mask |= GR_BIT(reg);
+        }
+        if (INS_IsCall(ins) || LeavesRoutine(rtn, ins))
+            mask |= CALLER_SAVED_GR;
+        if (INS_IsSyscall(ins))
+            mask |= SYSCALL_GR;
+    }
+    return mask;
+}
+
+// The width of the vector registers the CPU and the OS support: zmm with
+// AVX-512, ymm with AVX, else xmm
+static UINT32 VectorRegBytes()
+{
+    UINT32 a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE) || !(c & bit_AVX))
+        return 16;
+    UINT32 xcr0, xcr0High;
+    __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+    if ((xcr0 & 0x6) != 0x6)
+        return 16;
+    if (__get_cpuid_max(0, 0) >= 7)
+    {
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((b & bit_AVX512F) && (xcr0 & 0xe0) == 0xe0)
+            return 64;
+    }
+    return 32;
+}
+
+// TRACE_VREG number of reg, or NUM_TRACE_VREG if it is not a vector or
+// mask register
+static UINT32 VectorRegIndex(REG reg)
+{
+    if (REG_is_xmm(reg))
+        return reg - REG_XMM_BASE;
+    if (REG_is_ymm(reg))
+        return reg - REG_YMM_BASE;
+    if (REG_is_zmm(reg))
+        return reg - REG_ZMM_BASE;
+    if (REG_is_k_mask(reg))
+        return TRACE_VREG_K0 + reg - REG_K_BASE;
+    return NUM_TRACE_VREG;
+}
+
+// The vector registers, as a VREG_BIT mask, the routine can change. Any
+// write of a narrower view counts for the full register
+static UINT64 RoutineWrittenVregs(RTN rtn)
+{
+    if (!numVregs)
+        return 0;
+    UINT64 all = VREG_BIT(numVregs) - 1;
+    UINT64 mask = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins) && mask != all; ins = INS_Next(ins))
+    {
+        for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); i++)
+        {
+            UINT32 idx = VectorRegIndex(INS_RegW(ins, i));
+            if (idx < numVregs)
+                mask |= VREG_BIT(idx);
+        }
+        if (INS_IsCall(ins) || LeavesRoutine(rtn, ins))
+            mask = all;
+    }
+    return mask;
+}
+
+// Insert a call that records or counts something at ins or, if ins is
+// not valid, at the entry of rtn. While gated, Gate guards it so that a
+// thread that does not record pays one inlined test. Frees args
+static VOID InsertRecordCall(RTN rtn, INS ins, IPOINT where, BOOL predicated, AFUNPTR fun, IARGLIST args)
+{
+    if (!INS_Valid(ins) && !gated)
+    {
+        RTN_InsertCall(rtn, where, fun, IARG_IARGLIST, args, IARG_END);
+        IARGLIST_Free(args);
+        return;
+    }
+    if (!INS_Valid(ins))
+        ins = RTN_InsHead(rtn);
+
+    if (gated && predicated)
+    {
+        INS_InsertIfPredicatedCall(ins, where, (AFUNPTR)Gate, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_END);
+        INS_InsertThenPredicatedCall(ins, where, fun, IARG_IARGLIST, args, IARG_END);
+    }
+    else if (gated)
+    {
+        INS_InsertIfCall(ins, where, (AFUNPTR)Gate, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_END);
+        INS_InsertThenCall(ins, where, fun, IARG_IARGLIST, args, IARG_END);
+    }
+    else if (predicated)
+    {
+        INS_InsertPredicatedCall(ins, where, fun, IARG_IARGLIST, args, IARG_END);
+    }
+    else
+    {
+        INS_InsertCall(ins, where, fun, IARG_IARGLIST, args, IARG_END);
+    }
+    IARGLIST_Free(args);
+}
+
+static IARGLIST MemArgs(INS ins, UINT32 memOp)
+{
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_THREAD_ID, IARG_INST_PTR, IARG_MEMORYOP_EA, memOp,
+                          IARG_UINT32, INS_MemoryOperandSize(ins, memOp), IARG_END);
+    return args;
+}
+
+static IARGLIST ThreadArgs()
+{
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_THREAD_ID, IARG_END);
+    return args;
+}
+
+static IARGLIST RoutineArgs(const RTN_COUNT * rc)
+{
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_THREAD_ID, IARG_UINT32, rc->_id, IARG_ADDRINT, rc->_address,
+                          IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    return args;
+}
+
+static IARGLIST ReturnArgs()
+{
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    return args;
+}
+
+static IARGLIST CountArgs(UINT32 id, UINT32 counter)
+{
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                          IARG_UINT32, id, IARG_UINT32, counter, IARG_END);
+    return args;
+}
+
+// Insert one call that records the registers in mask, at the entry of rtn
+// or, if ins is valid, at the return ins. The registers go first, the
+// remaining arguments are 0
+static VOID InsertRegisterCalls(RTN rtn, INS ins, UINT32 mask)
+{
+    if (!mask)
+        return;
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, mask, IARG_END);
+    UINT32 n = 0;
+    for (int reg = (int)REG_GR_BASE; reg <= (int)REG_GR_LAST; ++reg)
+    {
+        if (mask & GR_BIT(reg))
+        {
+            IARGLIST_AddArguments(args, IARG_REG_VALUE, (REG)reg, IARG_END);
+            n++;
+        }
+    }
+    for (; n < NUM_GR; n++)
+        IARGLIST_AddArguments(args, IARG_ADDRINT, (ADDRINT)0, IARG_END);
+    InsertRecordCall(rtn, ins, IPOINT_BEFORE, false,
+                     INS_Valid(ins) ? (AFUNPTR)RecordExitRegisters : (AFUNPTR)RecordEntryRegisters, args);
+}
+
+// Insert one call that records the vector registers in mask, before ins
+// or, if ins is not valid, at the entry of rtn
+static VOID InsertVectorRegisterCalls(RTN rtn, INS ins, UINT64 mask)
+{
+    if (!mask)
+        return;
+    REGSET in;
+    REGSET out;
+    REGSET_Clear(in);
+    REGSET_Clear(out);
+    for (UINT32 idx = 0; idx < numVregs; idx++)
+    {
+        if (mask & VREG_BIT(idx))
+            REGSET_Insert(in, VectorReg(idx));
+    }
+    IARGLIST args = IARGLIST_Alloc();
+    IARGLIST_AddArguments(args, IARG_THREAD_ID, IARG_UINT64, mask, IARG_PARTIAL_CONTEXT, &in, &out, IARG_END);
+    InsertRecordCall(rtn, ins, IPOINT_BEFORE, false, (AFUNPTR)RecordVectorRegisters, args);
+}
+
+// Insert the calls that start or stop the ROI, if rtn is one of the markers
+static VOID InstrumentRoiMarkers(RTN rtn)
+{
+    const string & name = RTN_Name(rtn);
+    if (name.empty())
+        return;
+    if (name == KnobRoiStart.Value())
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)StartRoi, IARG_THREAD_ID, IARG_END);
+    if (name == KnobRoiStop.Value())
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)StopRoi, IARG_THREAD_ID, IARG_END);
+    if (name == KnobRoiRtn.Value())
+    {
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)EnterRoi, IARG_THREAD_ID, IARG_END);
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)ExitRoi, IARG_THREAD_ID, IARG_END);
+    }
+}
+
+// Shell-style match of name against a pattern of literals, * and ?
+static BOOL GlobMatch(const char * pattern, const char * name)
+{
+    const char * star = 0;
+    const char * resume = 0;
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = name;
+        }
+        else if (*pattern == '?' || *pattern == *name)
+        {
+            pattern++;
+            name++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == 0;
+}
+
+// An unset append knob still holds its empty default
+static BOOL HasPatterns(KNOB<string> & knob)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++)
+    {
+        if (!knob.Value(i).empty())
+            return true;
+    }
+    return false;
+}
+
+static BOOL MatchesAny(KNOB<string> & knob, const char * name)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++)
+    {
+        if (!knob.Value(i).empty() && GlobMatch(knob.Value(i).c_str(), name))
+            return true;
+    }
+    return false;
+}
+
+// Whether rtn passes the -main_only, -image_* and -rtn_* filters. Image
+// globs are matched against the file name without its directory
+static BOOL RoutineSelected(RTN rtn, const char * name, const char * image)
+{
+    if (KnobMainOnly.Value() && !IMG_IsMainExecutable(SEC_Img(RTN_Sec(rtn))))
+        return false;
+    if (HasPatterns(KnobImageInclude) && !MatchesAny(KnobImageInclude, image))
+        return false;
+    if (MatchesAny(KnobImageExclude, image))
+        return false;
+    if (HasPatterns(KnobRtnInclude) && !MatchesAny(KnobRtnInclude, name))
+        return false;
+    return !MatchesAny(KnobRtnExclude, name);
+}
+
+static UINT32 HashString(const char * str)
+{
+    UINT32 hash = 2166136261u;
+    for (; *str; str++)
+        hash = (hash ^ (UINT8)*str) * 16777619u;
+    return hash;
+}
+
+static inline UINT32 HashAddress(ADDRINT address)
+{
+    return (UINT32)(((UINT64)address * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static VOID AddString(const char ** hash, UINT32 size, const char * str)
+{
+    UINT32 i = HashString(str) & (size - 1);
+    while (hash[i])
+        i = (i + 1) & (size - 1);
+    hash[i] = str;
+}
+
+// The one copy of str that all routines share
+static const char * Intern(const string & str)
+{
+    if (2 * (numStrings + 1) > stringHashSize)
+    {
+        UINT32 size = stringHashSize ? stringHashSize * 2 : 4096;
+        const char ** hash = new const char *[size];
+        memset(hash, 0, size * sizeof(hash[0]));
+        for (UINT32 i = 0; i < stringHashSize; i++)
+        {
+            if (StringHash[i])
+                AddString(hash, size, StringHash[i]);
+        }
+        delete[] StringHash;
+        StringHash = hash;
+        stringHashSize = size;
+    }
+
+    for (UINT32 i = HashString(str.c_str()) & (stringHashSize - 1); StringHash[i]; i = (i + 1) & (stringHashSize - 1))
+    {
+        if (str == StringHash[i])
+            return StringHash[i];
+    }
+
+    size_t len = str.size() + 1;
+    if (len > stringLeft)
+    {
+        stringLeft = len > STRING_BLOCK_SIZE ? len : STRING_BLOCK_SIZE;
+        stringBlock = new char[stringLeft];
+    }
+    char * copy = stringBlock;
+    memcpy(copy, str.c_str(), len);
+    stringBlock += len;
+    stringLeft -= len;
+
+    AddString(StringHash, stringHashSize, copy);
+    numStrings++;
+    return copy;
+}
+
+static inline RTN_COUNT * RtnById(UINT32 id)
+{
+    return &RtnBlocks[id / COUNTER_BLOCK_RTNS][id % COUNTER_BLOCK_RTNS];
+}
+
+static VOID AddRtn(UINT32 * hash, UINT32 size, const RTN_COUNT * rc)
+{
+    UINT32 i = HashAddress(rc->_address) & (size - 1);
+    while (hash[i])
+        i = (i + 1) & (size - 1);
+    hash[i] = rc->_id + 1;
+}
+
+static RTN_COUNT * FindRtn(ADDRINT address)
+{
+    if (rtnHashSize == 0)
+        return 0;
+    for (UINT32 i = HashAddress(address) & (rtnHashSize - 1); RtnHash[i]; i = (i + 1) & (rtnHashSize - 1))
+    {
+        RTN_COUNT * rc = RtnById(RtnHash[i] - 1);
+        if (rc->_address == address)
+            return rc;
+    }
+    return 0;
+}
+
+// Find or create the RTN_COUNT of rtn. The filters are applied here, the
+// first time a routine is seen
+static RTN_COUNT * GetRtnCount(RTN rtn)
+{
+    RTN_COUNT * rc = FindRtn(RTN_Address(rtn));
+    if (rc)
+        return rc;
+
+    if (numRtns == COUNTER_BLOCK_RTNS * MAX_COUNTER_BLOCKS)
+    {
+        PIN_WriteErrorMessage("too many routines", 1001, PIN_ERR_FATAL, 0);
+    }
+    if (numRtns % COUNTER_BLOCK_RTNS == 0)
+        RtnBlocks[numRtns / COUNTER_BLOCK_RTNS] = new RTN_COUNT[COUNTER_BLOCK_RTNS];
+
+    if (2 * (numRtns + 1) > rtnHashSize)
+    {
+        UINT32 size = rtnHashSize ? rtnHashSize * 2 : 4096;
+        UINT32 * hash = new UINT32[size];
+        memset(hash, 0, size * sizeof(hash[0]));
+        for (UINT32 id = 0; id < numRtns; id++)
+            AddRtn(hash, size, RtnById(id));
+        delete[] RtnHash;
+        RtnHash = hash;
+        rtnHashSize = size;
+    }
+
+    // Allocate a counter for this routine
+    rc = RtnById(numRtns);
+    memset(rc, 0, sizeof(*rc));
+
+    // The RTN goes away when the image is unloaded, so save it now
+    // because we need it in the fini
+    rc->_name = Intern(RTN_Name(rtn));
+    rc->_image = Intern(StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str()));
+    rc->_address = RTN_Address(rtn);
+    rc->_id = numRtns++;
+    rc->_selected = RoutineSelected(rtn, rc->_name, rc->_image);
+    if (!rc->_selected)
+    {
+        SKIP_COUNT & skipped = SkippedByImage[rc->_image];
+        skipped._rtns++;
+        skipped._bytes += RTN_Size(rtn);
+    }
+    AddRtn(RtnHash, rtnHashSize, rc);
+
+    // Threads that are already running need counters for the new id
+    if (rc->_id % COUNTER_BLOCK_RTNS == 0)
+    {
+        PIN_GetLock(&threadsLock, PIN_ThreadId() + 1);
+        for (size_t t = 0; t < allThreads.size(); t++)
+            AllocCounters(allThreads[t], numRtns);
+        PIN_ReleaseLock(&threadsLock);
+    }
+    return rc;
+}
+
+// -footprint and -cache replace all recording calls of the routine
+static VOID InstrumentAccesses(RTN rtn, const RTN_COUNT * rc)
+{
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++)
+        {
+            if (cacheSim)
+            {
+                IARGLIST args = IARGLIST_Alloc();
+                IARGLIST_AddArguments(args, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, rc->_id,
+                                      IARG_MEMORYOP_EA, memOp, IARG_UINT32, INS_MemoryOperandSize(ins, memOp), IARG_END);
+                InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, (AFUNPTR)CacheRecord, args);
+            }
+            for (UINT32 flag = FOOT_READ; footprint && flag <= FOOT_WRITE; flag++)
+            {
+                if (flag == FOOT_READ ? !INS_MemoryOperandIsRead(ins, memOp) : !INS_MemoryOperandIsWritten(ins, memOp))
+                    continue;
+                IARGLIST args = IARGLIST_Alloc();
+                IARGLIST_AddArguments(args, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, rc->_id,
+                                      IARG_MEMORYOP_EA, memOp, IARG_UINT32, INS_MemoryOperandSize(ins, memOp),
+                                      IARG_UINT32, flag, IARG_END);
+                InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, (AFUNPTR)FootprintAccess, args);
+            }
+        }
+    }
+}
+
+// Pin calls this function every time a new rtn is executed
+VOID Routine(RTN rtn, VOID *v)
+{
+    INSTRUMENT_TIMER timer(routineUs);
+    RTN_COUNT * rc = GetRtnCount(rtn);
+
+    RTN_Open(rtn);
+
+    InstrumentRoiMarkers(rtn);
+
+    // Outside the ROI, Trace() only keeps the -skip countdown. Filtered
+    // routines get no analysis calls at all, apart from ROI markers
+    if (!recording || !rc->_selected)
+    {
+        RTN_Close(rtn);
+        return;
+    }
+
+    // Insert a call at the entry point of a routine to increment the call count
+    InsertRecordCall(rtn, INS_Invalid(), IPOINT_BEFORE, false, (AFUNPTR)docount, CountArgs(rc->_id, CNT_CALLS));
+
+    if (footprint || cacheSim)
+    {
+        InstrumentAccesses(rtn, rc);
+        RTN_Close(rtn);
+        return;
+    }
+    // BeforeRoutine first, so that the REC_RTN_EXIT of frames it pops
+    // comes before this routine's entry registers
+    UINT32 regMask = RoutineWrittenRegs(rtn);
+    UINT64 vregMask = RoutineWrittenVregs(rtn);
+    InsertRecordCall(rtn, INS_Invalid(), IPOINT_BEFORE, false, (AFUNPTR)BeforeRoutine, RoutineArgs(rc));
+    InsertRegisterCalls(rtn, INS_Invalid(), regMask);
+    InsertVectorRegisterCalls(rtn, INS_Invalid(), vregMask);
+
+    // For each instruction of the routine
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+        // Iterate over each memory operand of the instruction.
+        // With the logical clock and no load values, a load's records wait
+        // for it to read, see FlushLoads. Not a return's, which must come
+        // before its REC_RTN_EXIT, and which reads the thread's own stack
+        BOOL holdLoads = stampClock == STAMP_LOGICAL && !loadValues && INS_IsMemoryRead(ins) && !INS_IsRet(ins) &&
+                         (INS_IsValidForIpointAfter(ins) || INS_IsValidForIpointTakenBranch(ins));
+        AFUNPTR readFun = (AFUNPTR)(loadValues ? RecordMemReadValue : holdLoads ? HoldMemRead : RecordMemRead);
+
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        {
+            if (INS_MemoryOperandIsRead(ins, memOp))
+            {
+                InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, readFun, MemArgs(ins, memOp));
+            }
+            // Note that in some architectures a single memory operand can be 
+            // both read and written (for instance incl (%eax) on IA-32)
+            // In that case we instrument it once for read and once for write.
+            if (INS_MemoryOperandIsWritten(ins, memOp))
+            {
+                InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, (AFUNPTR)RecordMemWrite, MemArgs(ins, memOp));
+            }
+        }
+        if (holdLoads)
+        {
+            // Ahead of the stored data, which follows the REC_WRITE
+            if (INS_IsValidForIpointAfter(ins))
+                InsertRecordCall(rtn, ins, IPOINT_AFTER, true, (AFUNPTR)FlushLoads, ThreadArgs());
+            if (INS_IsValidForIpointTakenBranch(ins))
+                InsertRecordCall(rtn, ins, IPOINT_TAKEN_BRANCH, true, (AFUNPTR)FlushLoads, ThreadArgs());
+        }
+        if (KnobStoreValues && INS_IsMemoryWrite(ins))
+        {
+            // Pick up the stored data wherever execution continues
+            if (INS_IsValidForIpointAfter(ins))
+                InsertRecordCall(rtn, ins, IPOINT_AFTER, true, (AFUNPTR)RecordWriteValue, ThreadArgs());
+            if (INS_IsValidForIpointTakenBranch(ins))
+                InsertRecordCall(rtn, ins, IPOINT_TAKEN_BRANCH, true, (AFUNPTR)RecordWriteValue, ThreadArgs());
+        }
+        if (stampClock == STAMP_TSC && INS_IsAtomicUpdate(ins) && INS_IsValidForIpointAfter(ins))
+        {
+            InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, (AFUNPTR)StampAtomic, ThreadArgs());
+            InsertRecordCall(rtn, ins, IPOINT_AFTER, true, (AFUNPTR)StampAtomic, ThreadArgs());
+        }
+
+        // Every return leaves the routine; paths without one are handled
+        // by the shadow stack, see PopFrames
+        if (INS_IsRet(ins))
+        {
+            InsertRegisterCalls(rtn, ins, regMask);
+            InsertVectorRegisterCalls(rtn, ins, vregMask);
+            InsertRecordCall(rtn, ins, IPOINT_BEFORE, false, (AFUNPTR)AfterRoutine, ReturnArgs());
+        }
+    }
+
+    RTN_Close(rtn);
+}
+
+static UINT32 GetBblId(ADDRINT address)
+{
+    map<ADDRINT, UINT32>::iterator it = BblIds.find(address);
+    if (it != BblIds.end())
+        return it->second;
+
+    if (numBbls + 1 == BBV_BLOCK_BBLS * MAX_BBV_BLOCKS)
+    {
+        PIN_WriteErrorMessage("too many basic blocks", 1002, PIN_ERR_FATAL, 0);
+    }
+    UINT32 id = ++numBbls;
+    BblIds[address] = id;
+
+    // Threads that are already running need slots for the new id
+    if (id % BBV_BLOCK_BBLS == 0)
+    {
+        PIN_GetLock(&threadsLock, PIN_ThreadId() + 1);
+        for (size_t t = 0; t < allThreads.size(); t++)
+            AllocBbv(allThreads[t], id + 1);
+        PIN_ReleaseLock(&threadsLock);
+    }
+    return id;
+}
 
-// This function is called before every instruction is executed
-VOID docount(UINT64 * counter)
+// Interval countdown and basic block vector counting. Both run whether or
+// not the program is being recorded, in the routines the filters select
+static VOID InstrumentInterval(BBL bbl)
 {
-    (*counter)++;
+    RTN rtn = INS_Rtn(BBL_InsHead(bbl));
+    if (!RTN_Valid(rtn) || !GetRtnCount(rtn)->_selected)
+        return;
+
+    if (bbvFile.is_open())
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountBbv, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                       IARG_UINT32, GetBblId(BBL_Address(bbl)), IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)IntervalTick, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                     IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)EndInterval, IARG_THREAD_ID, IARG_END);
 }
 
-/* ===================================================================== */
-// Command line switches
-/* ===================================================================== */
+// Count instructions and memory accesses once per basic block, with the
+// counts computed here rather than one analysis call per instruction
+VOID Trace(TRACE trace, VOID *v)
+{
+    INSTRUMENT_TIMER timer(traceUs);
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (intervals)
+            InstrumentInterval(bbl);
 
+        if (!recording)
+        {
+            if (skipLeft > 0)
+            {
+                BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)SkipCountdown, IARG_FAST_ANALYSIS_CALL,
+                                 IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+                BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)StartRoi, IARG_THREAD_ID, IARG_END);
+            }
+            continue;
+        }
 
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "proccount.out", "specify output file name");
+        RTN rtn = INS_Rtn(BBL_InsHead(bbl));
+        if ((!KnobCount && !sampling && !cct) || !RTN_Valid(rtn))
+            continue;
+        RTN_COUNT * rc = GetRtnCount(rtn);
+        if (!rc->_selected)
+            continue;
 
-KNOB<BOOL>   KnobCount(KNOB_MODE_WRITEONCE,  "pintool",
-    "count", "1", "count instructions, basic blocks and threads in the application");
+        // Predicated instructions only access memory when they execute, so
+        // they keep a counting call of their own
+        UINT32 numMem = 0;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            UINT32 memOperands = INS_MemoryOperandCount(ins);
+            for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+            {
+                UINT32 accesses = (INS_MemoryOperandIsRead(ins, memOp) ? 1 : 0)
+                    + (INS_MemoryOperandIsWritten(ins, memOp) ? 1 : 0);
+                if (!INS_IsPredicated(ins))
+                {
+                    numMem += accesses;
+                    continue;
+                }
+                for (UINT32 i = 0; KnobCount && i < accesses; i++)
+                {
+                    InsertRecordCall(rtn, ins, IPOINT_BEFORE, true, (AFUNPTR)docount, CountArgs(rc->_id, CNT_MEMACC));
+                }
+            }
+        }
 
-/* ===================================================================== */
-// Utilities
-/* ===================================================================== */
+        rc->_blocks++;
+        rc->_blockIns += BBL_NumIns(bbl);
 
-VOID AddRegValToArr(int reg, ADDRINT val) {
-    if(reg<16)
-        regval[reg-3] = val;
-    else
-        regval[reg-55+16] = val;
+        // While sampling, the countdown is all that runs outside a burst
+        if (sampling)
+        {
+            BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)SampleTick, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                             IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+            BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)SampleBbl, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                               IARG_UINT32, rc->_id, IARG_UINT32, BBL_NumIns(bbl), IARG_UINT32, numMem, IARG_END);
+        }
+        else if (gated)
+        {
+            // Only the threads in one of their -simpoints count
+            BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)Gate, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_END);
+            BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)(cct ? CountBblCct : CountBbl), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                               IARG_UINT32, rc->_id, IARG_UINT32, BBL_NumIns(bbl), IARG_UINT32, numMem, IARG_END);
+        }
+        else
+        {
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)(cct ? CountBblCct : CountBbl), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg,
+                           IARG_UINT32, rc->_id, IARG_UINT32, BBL_NumIns(bbl), IARG_UINT32, numMem, IARG_END);
+        }
+    }
 }
 
-ADDRINT GetRegValFromArr(int reg) {
-    if(reg<16)
-        return regval[reg-3];
-    else
-        return regval[reg-55+16];
+VOID ThreadStart(THREADID tid, CONTEXT * ctxt, INT32 flags, VOID * v)
+{
+    VOID * mem;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(THREAD_DATA)) != 0)
+    {
+        PIN_WriteErrorMessage("cannot allocate thread data", 1000, PIN_ERR_FATAL, 0);
+    }
+    THREAD_DATA * td = new (mem) THREAD_DATA;
+    memset(td, 0, sizeof(THREAD_DATA));
+    td->_tid = tid;
+    td->_prof[PROF_CONTEXTS]++;
+    td->_out = NewBuffer(td);
+    for (UINT32 i = 1; i < KnobWriterBuffers.Value(); i++)
+    {
+        OUT_BUFFER * out = NewBuffer(td);
+        out->_next = td->_spare;
+        td->_spare = out;
+    }
+    td->_buf = td->_out->_recs;
+    td->_cur = td->_buf;
+    td->_end = td->_buf + KnobBufferRecords.Value();
+    SetLimit(td);
+    if (KnobCompress.Value() || verifying)
+        td->_codec = new CODEC_STATE;
+
+    // Threads start in a burst
+    td->_inBurst = 1;
+    td->_samplePeriod = KnobSampleBurst.Value();
+    td->_sampleLeft = td->_samplePeriod;
+    PIN_SetThreadData(tlsKey, td, tid);
+    PIN_SetContextReg(ctxt, tdReg, reinterpret_cast<ADDRINT>(td));
+
+    PIN_GetLock(&threadsLock, tid + 1);
+    AllocCounters(td, numRtns);
+    AllocBbv(td, numBbls + 1);
+    allThreads.push_back(td);
+    PIN_ReleaseLock(&threadsLock);
+
+    if (cacheSim)
+        AllocCache(td);
+    if (cct)
+        td->_ctx = td->_cctRoot = NewCctNode(NO_RTN, 0);
+
+    td->_intervalLeft = KnobInterval.Value();
+    UpdateGate(td);
+    if (!SimPoints.empty())
+        CheckSimPoint(td);
+
+    // Orders the thread's events after the system call that created it
+    if (EventsRecorded(td))
+        AcquireClock(td, &kernelClock);
 }
 
-const char * StripPath(const char * path)
+// Queue whatever the thread recorded since its last drain. Its counters
+// are kept until Fini merges them
+VOID ThreadFini(THREADID tid, const CONTEXT * ctxt, INT32 code, VOID * v)
 {
-    const char * file = strrchr(path,'/');
-    if (file)
-        return file+1;
+    THREAD_DATA * td = GetThreadData(tid);
+    if (bbvFile.is_open())
+        WriteBbv(td, KnobInterval.Value() - td->_intervalLeft);
+    if (td->_inSimPoint)
+    {
+        td->_inSimPoint = false;
+        td->_gate = 0;
+        ExitRoi(tid);
+    }
+    DrainBuffer(td, true);
+    if (cacheSim)
+    {
+        CacheFlush(td);
+        FreeCache(td);
+    }
+    FreeShadow(&td->_shadow);
+
+    // Buffers still queued are freed when the writer hands them back
+    __atomic_store_n(&td->_finished, true, __ATOMIC_SEQ_CST);
+    if (td->_out)
+        td->_out->_next = td->_spare;
     else
-        return path;
+        td->_out = td->_spare;
+    DeleteBuffers(td->_out);
+    DeleteBuffers(TakeBuffers(&td->_free));
+    td->_out = td->_spare = 0;
+    td->_buf = td->_cur = td->_end = td->_limit = 0;
+    delete td->_codec;
+    td->_codec = 0;
+    delete[] td->_expected;
+    delete[] td->_expectedEvents;
+    delete[] td->_verifyPacked;
+    td->_expected = 0;
+    td->_expectedEvents = 0;
+    td->_verifyPacked = 0;
+    delete[] td->_stack;
+    td->_stack = 0;
+    td->_depth = td->_stackCap = 0;
 }
 
+// Union the threads' line sets and count lines and pages per routine
+static VOID MergeFootprints()
+{
+    FOOT_SET lines;
+    FOOT_SET pages;
+    memset(&lines, 0, sizeof(lines));
+    memset(&pages, 0, sizeof(pages));
+    for (size_t t = 0; t < allThreads.size(); t++)
+    {
+        FOOT_SET & own = allThreads[t]->_footprint;
+        for (UINT32 i = 0; i < own._size; i++)
+        {
+            if (own._entries[i]._flags)
+                FootFind(&lines, own._entries[i]._rtn, own._entries[i]._line)->_flags |= own._entries[i]._flags;
+        }
+        delete[] own._entries;
+        memset(&own, 0, sizeof(own));
+    }
 
-/////////////////////
-// ANALYSIS FUNCTIONS
-/////////////////////
+    for (UINT32 i = 0; i < lines._size; i++)
+    {
+        const FOOT_ENTRY & e = lines._entries[i];
+        if (e._flags == 0)
+            continue;
+        RTN_COUNT * rc = RtnById(e._rtn);
+        rc->_lines++;
+        if (e._flags & FOOT_READ)
+            rc->_readLines++;
+        if (e._flags & FOOT_WRITE)
+            rc->_writeLines++;
+        FOOT_ENTRY * page = FootFind(&pages, e._rtn, e._line / FOOT_PAGE_LINES);
+        if (page->_flags == 0)
+            rc->_pages++;
+        page->_flags = FOOT_READ;
+    }
+    delete[] lines._entries;
+    delete[] pages._entries;
+}
 
+// Add the tree under src into the one under dst and free it. Iterative,
+// since call paths can be deeper than the stack Fini runs on
+static VOID MergeCctInto(CCT_NODE * dst, CCT_NODE * src)
+{
+    vector<pair<CCT_NODE *, CCT_NODE *> > work;
+    work.push_back(make_pair(dst, src));
+    while (!work.empty())
+    {
+        CCT_NODE * to = work.back().first;
+        CCT_NODE * from = work.back().second;
+        work.pop_back();
+        to->_calls += from->_calls;
+        to->_icount += from->_icount;
+        to->_memacc += from->_memacc;
+        for (CCT_NODE * child = from->_child; child; child = child->_sibling)
+            work.push_back(make_pair(CctChild(to, child->_rtn), child));
+    }
 
-FILE * trace;
+    vector<CCT_NODE *> dead(1, src);
+    while (!dead.empty())
+    {
+        CCT_NODE * node = dead.back();
+        dead.pop_back();
+        for (CCT_NODE * child = node->_child; child; child = child->_sibling)
+            dead.push_back(child);
+        delete node;
+    }
+}
 
-// Print a memory read record
-static void RecordMemRead(VOID * ip, VOID * addr)
+// The nodes under root, parents before children
+static VOID CctPreorder(CCT_NODE * root, vector<CCT_NODE *> & nodes)
 {
-    outFile << ip << ": R" << addr << endl;
-    // fprintf(trace,"%p: R %p\n", ip, addr);
+    nodes.clear();
+    nodes.push_back(root);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        for (CCT_NODE * child = nodes[i]->_child; child; child = child->_sibling)
+            nodes.push_back(child);
+    }
 }
 
-// Print a memory write record
-static void RecordMemWrite(VOID * ip, VOID * addr)
+// Merge every thread's tree into cctRoot and add up inclusive costs
+static VOID MergeCct()
 {
-    outFile << ip << ": R" << addr << endl;
-    // fprintf(trace,"%p: W %p\n", ip, addr);
+    cctRoot = NewCctNode(NO_RTN, 0);
+    for (size_t t = 0; t < allThreads.size(); t++)
+    {
+        if (allThreads[t]->_cctRoot)
+            MergeCctInto(cctRoot, allThreads[t]->_cctRoot);
+        allThreads[t]->_cctRoot = allThreads[t]->_ctx = 0;
+    }
+
+    vector<CCT_NODE *> nodes;
+    CctPreorder(cctRoot, nodes);
+    for (size_t i = nodes.size(); i-- > 0; )
+    {
+        CCT_NODE * node = nodes[i];
+        node->_inclIcount += node->_icount;
+        node->_inclMemacc += node->_memacc;
+        if (node->_parent)
+        {
+            node->_parent->_inclIcount += node->_inclIcount;
+            node->_parent->_inclMemacc += node->_inclMemacc;
+        }
+    }
 }
 
+static inline UINT64 Scaled(UINT64 count, double scale)
+{
+    return scale == 1.0 ? count : (UINT64)(count * scale + 0.5);
+}
 
-static void PrintRegisters(const CONTEXT * ctxt, int Order)
+// Sum the per-thread counters into each routine's RTN_COUNT
+static VOID MergeCounters()
 {
-    // static const UINT stRegSize = REG_Size(REG_ST_BASE);
-    for (int reg = (int)REG_GR_BASE; reg <= (int)REG_GR_LAST; ++reg)
+    // While sampling, each thread's counts are scaled by the fraction of
+    // its instructions that ran in bursts
+    vector<double> scale(allThreads.size(), 1.0);
+    for (size_t t = 0; sampling && t < allThreads.size(); t++)
+    {
+        THREAD_DATA * td = allThreads[t];
+        UINT64 current = td->_samplePeriod - td->_sampleLeft;
+        UINT64 total = td->_totalIns + current;
+        UINT64 sampled = td->_sampledIns + (td->_inBurst ? current : 0);
+        scale[t] = sampled ? (double)total / sampled : 0.0;
+    }
+
+    // Threads still running at exit have accesses left in their batch
+    for (size_t t = 0; cacheSim && t < allThreads.size(); t++)
     {
-        // For the integer registers, it is safe to use ADDRINT. But make sure to pass a pointer to it.
-        ADDRINT val;
-        PIN_GetContextRegval(ctxt, (REG)reg, reinterpret_cast<UINT8*>(&val));
-        // OutFile << reg << "..." << REG_StringShort((REG)reg) << ": 0x" << hex << val << endl;
-        if(Order==BEFORE) {
-            // outFile << REG_StringShort((REG)reg) << "\t0x" << setw(16) << left << hex << val << endl;
-            AddRegValToArr(reg, val);
+        if (allThreads[t]->_cacheBatch)
+        {
+            CacheFlush(allThreads[t]);
+            FreeCache(allThreads[t]);
         }
-        else {
-            ADDRINT oldval = GetRegValFromArr(reg);
-            if(oldval!=val)
-                outFile << REG_StringShort((REG)reg) << "\t0x" << setw(16) << left << hex << oldval << "\t" << "0x" << hex << val << endl;
+    }
+
+    for (UINT32 id = 0; id < numRtns; id++)
+    {
+        RTN_COUNT * rc = RtnById(id);
+        for (size_t t = 0; t < allThreads.size(); t++)
+        {
+            const UINT64 * counters = RtnCounters(allThreads[t], rc->_id);
+            rc->_rtnCount += Scaled(counters[CNT_CALLS], scale[t]);
+            rc->_icount += Scaled(counters[CNT_ICOUNT], scale[t]);
+            rc->_memacc += Scaled(counters[CNT_MEMACC], scale[t]);
+            rc->_reads += Scaled(counters[CNT_READS], scale[t]);
+            rc->_writes += Scaled(counters[CNT_WRITES], scale[t]);
+            rc->_callLines += Scaled(counters[CNT_CALL_LINES], scale[t]);
+            rc->_cacheAccesses += Scaled(counters[CNT_CACHE_ACCESSES], scale[t]);
+            for (UINT32 l = 0; l < CACHE_LEVELS; l++)
+                rc->_misses[l] += Scaled(counters[CNT_L1_MISSES + l], scale[t]);
         }
+    }
+    if (footprint)
+        MergeFootprints();
+    if (cct)
+        MergeCct();
+
+    for (size_t t = 0; t < allThreads.size(); t++)
+    {
+        for (UINT32 b = 0; b < MAX_COUNTER_BLOCKS; b++)
+            delete[] allThreads[t]->_counters[b];
+        for (UINT32 b = 0; b < MAX_BBV_BLOCKS; b++)
+            delete[] allThreads[t]->_bbv[b];
+        free(allThreads[t]);
+    }
+    allThreads.clear();
+}
+
+// Stop the writer before Pin ends the program's threads. Whatever is
+// queued after this is written by the thread that queues it
+VOID PrepareForFini(VOID * v)
+{
+    if (!writerRunning)
+        return;
+    writerExit = true;
+    PIN_SemaphoreSet(&writerSem);
+    PIN_WaitForThreadTermination(writerUid, PIN_INFINITE_TIMEOUT, 0);
+    writerRunning = false;
+}
 
+static UINT64 RtnMetric(const RTN_COUNT * rc)
+{
+    switch (sortBy)
+    {
+      case CNT_CALLS:
+        return rc->_rtnCount;
+      case CNT_MEMACC:
+        return rc->_memacc;
+      case CNT_LLC_MISSES:
+        return rc->_misses[CACHE_LEVELS - 1];
+      default:
+        return rc->_icount;
+    }
+}
 
+// Descending by the -sort metric, then by address
+struct ByMetric
+{
+    bool operator()(const RTN_COUNT * a, const RTN_COUNT * b) const
+    {
+        UINT64 ma = RtnMetric(a);
+        UINT64 mb = RtnMetric(b);
+        if (ma != mb)
+            return ma > mb;
+        return a->_address < b->_address;
     }
-    for (int reg = (int)REG_XMM_BASE; reg < (int)REG_XMM7; ++reg)
+};
+
+static UINT64 CctMetric(const CCT_NODE * node)
+{
+    switch (sortBy)
     {
-        // For the x87 FPU stack registers, using PIN_REGISTER ensures a large enough buffer.
-        PIN_REGISTER val;
-        PIN_GetContextRegval(ctxt, (REG)reg, reinterpret_cast<UINT8*>(&val));
-        // if(Order==BEFORE)
-        //     AddRegValToArr(reg, val);
-        // else {
-        //     ADDRINT oldval = GetRegValFromArr(reg);
-        //     if(oldval!=val)
-        //         OutFile << REG_StringShort((REG)reg) << "\t0x" << setw(16) << left << hex << oldval << "\t" << "0x" << hex << val << endl;
-        // }
-        // OutFile << REG_StringShort((REG)reg) << ": " << to_string(stRegSize) << endl;
+      case CNT_CALLS:
+        return node->_calls;
+      case CNT_MEMACC:
+        return node->_inclMemacc;
+      default:
+        return node->_inclIcount;
     }
 }
 
+// Descending by the inclusive -sort metric; instructions for -sort misses
+struct ByCctMetric
+{
+    bool operator()(const CCT_NODE * a, const CCT_NODE * b) const
+    {
+        return CctMetric(a) > CctMetric(b);
+    }
+};
 
-VOID BeforeRoutine(const CONTEXT * ctxt, RTN rtn)
+// Routine names from the outermost call down to node
+static string CctPath(const CCT_NODE * node, const char * separator)
 {
-    outFile <<  "===============================================" << endl;
-    outFile << "This is the Routine at Address: \n" << RTN_Address(rtn) << dec <<endl;
-    outFile << "-----------------------------------------------" << endl;
-    outFile << "Memory Accesses:" << endl;
-    // OutFile <<  "-----------------------------------------------" << endl;
-    // OutFile << "Before Basic Block" << endl;
-    PrintRegisters(ctxt, BEFORE);
+    vector<const char *> names;
+    for (; node && node->_rtn != NO_RTN; node = node->_parent)
+        names.push_back(RtnById(node->_rtn)->_name);
+    string path;
+    for (size_t i = names.size(); i-- > 0; )
+    {
+        path += names[i];
+        if (i)
+            path += separator;
+    }
+    return path;
 }
 
-VOID AfterRoutine(const CONTEXT * ctxt)
+static string CsvField(const char * str)
 {
-    outFile <<  "-----------------------------------------------" << endl;
-    outFile << "After Routine" << endl;
-    outFile << "Reg\t" << "Old Val\t\t\t" << "New Val"<< endl;
-    PrintRegisters(ctxt, AFTER);
-    outFile <<  "===============================================" << endl;
+    string field = "\"";
+    for (; *str; str++)
+    {
+        if (*str == '"')
+            field += '"';
+        field += *str;
+    }
+    return field + "\"";
 }
 
-// Pin calls this function every time a new rtn is executed
-VOID Routine(RTN rtn, VOID *v)
+static string JsonString(const char * str)
 {
-    
-    // Allocate a counter for this routine
-    RTN_COUNT * rc = new RTN_COUNT;
+    string json = "\"";
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            json += '\\';
+            json += *str;
+        }
+        else if ((UINT8)*str < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (UINT8)*str);
+            json += escape;
+        }
+        else
+        {
+            json += *str;
+        }
+    }
+    return json + "\"";
+}
 
-    // The RTN goes away when the image is unloaded, so save it now
-    // because we need it in the fini
-    rc->_name = RTN_Name(rtn);
-    rc->_image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
-    rc->_address = RTN_Address(rtn);
-    rc->_icount = 0;
-    rc->_rtnCount = 0;
-    rc->_memacc = 0;
+static double LinesPerCall(const RTN_COUNT * rc)
+{
+    return rc->_rtnCount ? (double)rc->_callLines / rc->_rtnCount : 0.0;
+}
+
+// Accesses per distinct line
+static double Reuse(const RTN_COUNT * rc)
+{
+    return rc->_lines ? (double)(rc->_reads + rc->_writes) / rc->_lines : 0.0;
+}
 
-    // Add to list of routines
-    rc->_next = RtnList;
-    RtnList = rc;
+// Percentage of line accesses that missed in L1
+static double L1MissRate(const RTN_COUNT * rc)
+{
+    return rc->_cacheAccesses ? 100.0 * rc->_misses[0] / rc->_cacheAccesses : 0.0;
+}
 
-    RTN_Open(rtn);
+// Last level misses per thousand instructions, 0 without -count
+static double LlcMpki(const RTN_COUNT * rc)
+{
+    return rc->_icount ? 1000.0 * rc->_misses[CACHE_LEVELS - 1] / rc->_icount : 0.0;
+}
 
-    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &(rc->_rtnCount), IARG_END);
-    // Insert a call at the entry point of a routine to increment the call count
-    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)BeforeRoutine, IARG_CONST_CONTEXT, IARG_UINT32, rtn, IARG_END);
-    
-    INS ins = RTN_InsHead(rtn);
-    INS prev = ins;
+static VOID WriteTextReport(const vector<RTN_COUNT *> & rtns, size_t active, const UINT64 * prof)
+{
+    outFile << setw(18) << "Address" << " "
+          << setw(12) << "Calls" << " "
+          << setw(12) << "Instructions" << " "
+          << setw(12) << "Memory Accesses" << " "
+          << setw(23) << "Procedure" << " "
+          << setw(15) << "Image" << " " << endl;
 
-    
+    for (size_t i = 0; i < rtns.size(); i++)
+    {
+        const RTN_COUNT * rc = rtns[i];
+        outFile << setw(18) << hex << rc->_address << dec << " "
+              << setw(12) << rc->_rtnCount << " "
+              << setw(12) << rc->_icount << " "
+              << setw(12) << rc->_memacc << " "
+              << setw(23) << rc->_name << " "
+              << setw(15) << rc->_image << endl;
+    }
+    if (active > rtns.size())
+        outFile << "... " << active - rtns.size() << " more routines" << endl;
 
-    // For each instruction of the routine
-    for (; INS_Valid(ins); ins = INS_Next(ins))
+    if (footprint)
     {
-        UINT32 memOperands = INS_MemoryOperandCount(ins);
+        outFile << endl << "Footprint in " << CACHE_LINE_SIZE << " byte lines and 4096 byte pages:" << endl;
+        outFile << setw(18) << "Address" << " "
+                << setw(12) << "Lines" << " "
+                << setw(12) << "Pages" << " "
+                << setw(12) << "Read Lines" << " "
+                << setw(13) << "Written Lines" << " "
+                << setw(12) << "Lines/Call" << " "
+                << setw(13) << "Accesses/Line" << " "
+                << setw(23) << "Procedure" << endl;
+        for (size_t i = 0; i < rtns.size(); i++)
+        {
+            const RTN_COUNT * rc = rtns[i];
+            outFile << setw(18) << hex << rc->_address << dec << " "
+                    << setw(12) << rc->_lines << " "
+                    << setw(12) << rc->_pages << " "
+                    << setw(12) << rc->_readLines << " "
+                    << setw(13) << rc->_writeLines << " "
+                    << setw(12) << fixed << setprecision(1) << LinesPerCall(rc) << " "
+                    << setw(13) << Reuse(rc) << " "
+                    << setw(23) << rc->_name << endl;
+        }
+    }
 
-        // Iterate over each memory operand of the instruction.
-        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    if (cacheSim)
+    {
+        outFile << endl << "Cache hierarchy, " << (1u << cacheLineShift) << " byte lines, "
+                << KnobCachePolicy.Value() << ":";
+        const char * names[CACHE_LEVELS] = { "L1", "L2", "LLC" };
+        for (UINT32 l = 0; l < CACHE_LEVELS; l++)
+            outFile << " " << names[l] << " " << cacheSets[l] << "x" << cacheAssoc[l];
+        outFile << endl;
+        outFile << setw(18) << "Address" << " "
+                << setw(12) << "Accesses" << " "
+                << setw(12) << "L1 Misses" << " "
+                << setw(12) << "L2 Misses" << " "
+                << setw(12) << "LLC Misses" << " "
+                << setw(9) << "L1 Miss%" << " "
+                << setw(9) << "LLC MPKI" << " "
+                << setw(23) << "Procedure" << endl;
+        for (size_t i = 0; i < rtns.size(); i++)
         {
-            if (INS_MemoryOperandIsRead(ins, memOp))
-            {
-                INS_InsertPredicatedCall(
-                    ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                    IARG_INST_PTR,
-                    IARG_MEMORYOP_EA, memOp,
-                    IARG_END);
-                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &(rc->_memacc), IARG_END);
+            const RTN_COUNT * rc = rtns[i];
+            outFile << setw(18) << hex << rc->_address << dec << " "
+                    << setw(12) << rc->_cacheAccesses << " "
+                    << setw(12) << rc->_misses[0] << " "
+                    << setw(12) << rc->_misses[1] << " "
+                    << setw(12) << rc->_misses[2] << " "
+                    << setw(9) << fixed << setprecision(2) << L1MissRate(rc) << " "
+                    << setw(9) << LlcMpki(rc) << " "
+                    << setw(23) << rc->_name << endl;
+        }
+    }
 
-            }
-            // Note that in some architectures a single memory operand can be 
-            // both read and written (for instance incl (%eax) on IA-32)
-            // In that case we instrument it once for read and once for write.
-            if (INS_MemoryOperandIsWritten(ins, memOp))
-            {
-                INS_InsertPredicatedCall(
-                    ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                    IARG_INST_PTR,
-                    IARG_MEMORYOP_EA, memOp,
-                    IARG_END);
-                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &(rc->_memacc), IARG_END);
-            }
+    if (!SkippedByImage.empty())
+    {
+        outFile << endl << "Not instrumented because of filters:" << endl;
+        outFile << setw(23) << "Image" << " "
+                << setw(12) << "Routines" << " "
+                << setw(12) << "Code Bytes" << endl;
+        for (map<string, SKIP_COUNT>::iterator it = SkippedByImage.begin(); it != SkippedByImage.end(); ++it)
+        {
+            outFile << setw(23) << it->first << " "
+                    << setw(12) << it->second._rtns << " "
+                    << setw(12) << it->second._bytes << endl;
         }
-        // Insert a call to docount to increment the instruction counter for this rtn
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &(rc->_icount), IARG_END);
-        prev=ins;
     }
 
-    INS_InsertCall(prev, IPOINT_BEFORE, (AFUNPTR)AfterRoutine, IARG_CONST_CONTEXT, IARG_END);
+    outFile << endl << "Writer: " << writerStalls << " stalls, "
+            << droppedChunks << " chunks (" << droppedRecords << " records) dropped, "
+            << grownBuffers << " buffers added, "
+            << chunksWritten << " chunks (" << traceOffset << " bytes) written in " << writeUs / 1000 << " ms" << endl;
+    outFile << "Instrumentation: " << (routineUs + traceUs) / 1000 << " ms in " << instrumentCalls << " callbacks"
+            << " (Routine " << routineUs / 1000 << " ms, Trace " << traceUs / 1000 << " ms)" << endl;
 
-    RTN_Close(rtn);
+    outFile << "Analysis calls:";
+    for (UINT32 c = 0; c < NUM_PROF_CALLS; c++)
+    {
+        if (prof[c])
+            outFile << " " << ProfNames[c] << " " << prof[c];
+    }
+    outFile << endl;
+    outFile << "Threads: " << prof[PROF_CONTEXTS] << " contexts, "
+            << prof[PROF_DRAINS] << " drains in " << prof[PROF_DRAIN_US] / 1000 << " ms, "
+            << prof[PROF_QUEUED_BYTES] << " bytes queued, "
+            << prof[PROF_STALL_US] / 1000 << " ms stalled" << endl;
+    if (loadValues)
+        outFile << "Load values: " << prof[PROF_LOAD_VALUES] << " logged, "
+                << prof[PROF_ELIDED_VALUES] << " elided" << endl;
+}
+
+// Every call path to the -cct file and, with -report text, the -top
+// hottest ones after the routine table
+static VOID WriteCctReport()
+{
+    vector<CCT_NODE *> nodes;
+    CctPreorder(cctRoot, nodes);
+    nodes.erase(nodes.begin());
+
+    // The whole tree, with paths in the folded format flame graph tools read
+    ofstream cctFile(KnobCct.Value().c_str());
+    cctFile << "calls,incl_instructions,excl_instructions,incl_memory_accesses,excl_memory_accesses,path" << endl;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const CCT_NODE * node = nodes[i];
+        cctFile << node->_calls << "," << node->_inclIcount << "," << node->_icount << ","
+                << node->_inclMemacc << "," << node->_memacc << "," << CsvField(CctPath(node, ";").c_str()) << endl;
+    }
+
+    if (KnobReport.Value() != "text")
+        return;
+    size_t top = KnobTop.Value() && KnobTop.Value() < nodes.size() ? KnobTop.Value() : nodes.size();
+    partial_sort(nodes.begin(), nodes.begin() + top, nodes.end(), ByCctMetric());
+    outFile << endl << "Hottest call paths of " << nodes.size() << ":" << endl;
+    outFile << setw(12) << "Calls" << " "
+            << setw(14) << "Incl Instr" << " "
+            << setw(14) << "Excl Instr" << " "
+            << setw(14) << "Incl Memory" << " "
+            << setw(14) << "Excl Memory" << " "
+            << "Path" << endl;
+    for (size_t i = 0; i < top; i++)
+    {
+        const CCT_NODE * node = nodes[i];
+        outFile << setw(12) << node->_calls << " "
+                << setw(14) << node->_inclIcount << " "
+                << setw(14) << node->_icount << " "
+                << setw(14) << node->_inclMemacc << " "
+                << setw(14) << node->_memacc << " "
+                << CctPath(node, " > ") << endl;
+    }
+}
+
+static VOID WriteCsvReport(const vector<RTN_COUNT *> & rtns)
+{
+    outFile << "address,calls,instructions,memory_accesses,procedure,image";
+    if (footprint)
+        outFile << ",reads,writes,lines,pages,read_lines,written_lines,lines_per_call";
+    if (cacheSim)
+        outFile << ",cache_accesses,l1_misses,l2_misses,llc_misses";
+    outFile << endl;
+    for (size_t i = 0; i < rtns.size(); i++)
+    {
+        const RTN_COUNT * rc = rtns[i];
+        outFile << "0x" << hex << rc->_address << dec << ","
+                << rc->_rtnCount << ","
+                << rc->_icount << ","
+                << rc->_memacc << ","
+                << CsvField(rc->_name) << ","
+                << CsvField(rc->_image);
+        if (footprint)
+            outFile << "," << rc->_reads << "," << rc->_writes << "," << rc->_lines << "," << rc->_pages
+                    << "," << rc->_readLines << "," << rc->_writeLines << "," << LinesPerCall(rc);
+        if (cacheSim)
+            outFile << "," << rc->_cacheAccesses << "," << rc->_misses[0] << "," << rc->_misses[1]
+                    << "," << rc->_misses[2];
+        outFile << endl;
+    }
+}
+
+static VOID WriteJsonReport(const vector<RTN_COUNT *> & rtns, size_t active, const UINT64 * prof)
+{
+    outFile << "{" << endl;
+    outFile << "  \"sort\": " << JsonString(KnobSort.Value().c_str()) << "," << endl;
+    outFile << "  \"active_routines\": " << active << "," << endl;
+    outFile << "  \"routines\": [" << endl;
+    for (size_t i = 0; i < rtns.size(); i++)
+    {
+        const RTN_COUNT * rc = rtns[i];
+        outFile << "    {\"address\": \"0x" << hex << rc->_address << dec << "\""
+                << ", \"calls\": " << rc->_rtnCount
+                << ", \"instructions\": " << rc->_icount
+                << ", \"memory_accesses\": " << rc->_memacc
+                << ", \"procedure\": " << JsonString(rc->_name)
+                << ", \"image\": " << JsonString(rc->_image);
+        if (footprint)
+            outFile << ", \"reads\": " << rc->_reads
+                    << ", \"writes\": " << rc->_writes
+                    << ", \"lines\": " << rc->_lines
+                    << ", \"pages\": " << rc->_pages
+                    << ", \"read_lines\": " << rc->_readLines
+                    << ", \"written_lines\": " << rc->_writeLines
+                    << ", \"lines_per_call\": " << LinesPerCall(rc);
+        if (cacheSim)
+            outFile << ", \"cache_accesses\": " << rc->_cacheAccesses
+                    << ", \"l1_misses\": " << rc->_misses[0]
+                    << ", \"l2_misses\": " << rc->_misses[1]
+                    << ", \"llc_misses\": " << rc->_misses[2];
+        outFile << "}" << (i + 1 < rtns.size() ? "," : "") << endl;
+    }
+    outFile << "  ]," << endl;
+
+    outFile << "  \"skipped\": [" << endl;
+    for (map<string, SKIP_COUNT>::iterator it = SkippedByImage.begin(); it != SkippedByImage.end(); )
+    {
+        outFile << "    {\"image\": " << JsonString(it->first.c_str())
+                << ", \"routines\": " << it->second._rtns
+                << ", \"code_bytes\": " << it->second._bytes << "}";
+        ++it;
+        outFile << (it != SkippedByImage.end() ? "," : "") << endl;
+    }
+    outFile << "  ]," << endl;
+
+    outFile << "  \"writer\": {\"stalls\": " << writerStalls
+            << ", \"dropped_chunks\": " << droppedChunks
+            << ", \"dropped_records\": " << droppedRecords
+            << ", \"buffers_added\": " << grownBuffers << "}," << endl;
+    outFile << "  \"instrumentation\": {\"ms\": " << (routineUs + traceUs) / 1000
+            << ", \"routine_ms\": " << routineUs / 1000
+            << ", \"trace_ms\": " << traceUs / 1000
+            << ", \"callbacks\": " << instrumentCalls << "}," << endl;
+
+    outFile << "  \"profile\": {\"calls\": {";
+    for (UINT32 c = 0; c < NUM_PROF_CALLS; c++)
+        outFile << (c ? ", " : "") << JsonString(ProfNames[c]) << ": " << prof[c];
+    outFile << "}";
+    for (UINT32 c = NUM_PROF_CALLS; c < NUM_PROF_COUNTERS; c++)
+        outFile << ", " << JsonString(ProfNames[c]) << ": " << prof[c];
+    outFile << ", \"chunks_written\": " << chunksWritten
+            << ", \"written_bytes\": " << traceOffset
+            << ", \"write_us\": " << writeUs << "}" << endl;
+    outFile << "}" << endl;
 }
 
 // This function is called when the application exits
-// It prints the name and count for each procedure
+// It prints the -top routines by the -sort metric
 VOID Fini(INT32 code, VOID *v)
 {
-    outFile << setw(18) << "Address" << " "
-          << setw(12) << "Calls" << " "
-          << setw(12) << "Instructions" << " "
-          << setw(12) << "Memory Accesses" << " "
-          << setw(23) << "Procedure" << " "
-          << setw(15) << "Image" << " " << endl;
+    // Buffers queued while the writer was shutting down
+    WriteQueued(PIN_ThreadId());
 
-    for (RTN_COUNT * rc = RtnList; rc; rc = rc->_next)
+    // The self profile needs the threads, which MergeCounters frees
+    UINT64 prof[NUM_PROF_COUNTERS];
+    SumProfile(PIN_ThreadId(), prof);
+    MergeCounters();
+
+    vector<RTN_COUNT *> rtns;
+    for (UINT32 id = 0; id < numRtns; id++)
     {
-        if (rc->_icount > 0)
-            outFile << setw(18) << hex << rc->_address << dec << " "
-                  << setw(12) << rc->_rtnCount << " "
-                  << setw(12) << rc->_icount << " "
-                  << setw(12) << rc->_memacc << " "
-                  << setw(23) << rc->_name << " "
-                  << setw(15) << rc->_image << endl;
+        RTN_COUNT * rc = RtnById(id);
+        if (rc->_rtnCount || rc->_icount || rc->_memacc)
+            rtns.push_back(rc);
+    }
+    size_t active = rtns.size();
+    size_t top = KnobTop.Value() && KnobTop.Value() < active ? KnobTop.Value() : active;
+    partial_sort(rtns.begin(), rtns.begin() + top, rtns.end(), ByMetric());
+    rtns.resize(top);
+
+    if (KnobReport.Value() == "csv")
+        WriteCsvReport(rtns);
+    else if (KnobReport.Value() == "json")
+        WriteJsonReport(rtns, active, prof);
+    else
+        WriteTextReport(rtns, active, prof);
+    if (cct)
+        WriteCctReport();
+
+    if (verifying)
+    {
+        // Other formats keep to their schema; the divergence is on stderr
+        if (KnobReport.Value() == "text")
+        {
+            outFile << endl;
+            if (divergence._found)
+                WriteDivergence(outFile, divergence);
+            outFile << "Verified " << verifiedEvents << " events against " << KnobVerify.Value() << endl;
+        }
+        cerr << "Verified " << verifiedEvents << " events against " << KnobVerify.Value()
+             << (divergence._found ? ", diverged" : "") << endl;
     }
 
-    // fprintf(trace, "#eof\n");
-    // fclose(trace);
+    traceFile.close();
+    indexFile.close();
+    bbvFile.close();
+}
+
+// Read the output of offline/SimPoint.cpp: "tid interval weight ..." per
+// line, '#' starting a comment
+static BOOL ReadSimPoints(const string & name)
+{
+    ifstream in(name.c_str());
+    if (!in)
+        return false;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        UINT32 tid;
+        UINT64 interval;
+        if (sscanf(line.c_str(), "%u %llu", &tid, (unsigned long long *)&interval) == 2)
+            SimPoints.insert(make_pair(tid, interval));
+    }
+    return !SimPoints.empty();
 }
 
 /* ===================================================================== */
@@ -306,7 +4232,6 @@ INT32 Usage()
 
 int main(int argc, char * argv[])
 {
-    // trace = fopen("pinatrace.out", "w");
     // Initialize symbol table code, needed for rtn instrumentation
     PIN_InitSymbols();
 
@@ -315,8 +4240,178 @@ int main(int argc, char * argv[])
     // Initialize pin
     if (PIN_Init(argc, argv)) return Usage();
 
+    if (KnobBufferRecords.Value() == 0) return Usage();
+    if (KnobWriterBuffers.Value() < 2) return Usage();
+    if (KnobCheckpointKeyframe.Value() == 0) return Usage();
+
+    sampling = KnobSampleBurst.Value() > 0;
+    if (sampling && !KnobSampleMs.Value() && KnobSamplePeriod.Value() <= KnobSampleBurst.Value())
+        return Usage();
+
+    if (KnobSort.Value() == "calls")
+        sortBy = CNT_CALLS;
+    else if (KnobSort.Value() == "instructions")
+        sortBy = CNT_ICOUNT;
+    else if (KnobSort.Value() == "memory")
+        sortBy = CNT_MEMACC;
+    else if (KnobSort.Value() == "misses" && KnobCache.Value())
+        sortBy = CNT_LLC_MISSES;
+    else
+        return Usage();
+    if (KnobReport.Value() != "text" && KnobReport.Value() != "csv" && KnobReport.Value() != "json")
+        return Usage();
+
+    if (KnobStamp.Value() == "logical")
+        stampClock = STAMP_LOGICAL;
+    else if (KnobStamp.Value() == "tsc")
+        stampClock = STAMP_TSC;
+    else if (KnobStamp.Value() == "none")
+        stampClock = STAMP_NONE;
+    else
+        return Usage();
+    stampEvents = stampClock == STAMP_NONE ? 0 : KnobStampEvents.Value();
+
+    if (KnobBackpressure.Value() == "block")
+        backpressure = BP_BLOCK;
+    else if (KnobBackpressure.Value() == "drop")
+        backpressure = BP_DROP;
+    else if (KnobBackpressure.Value() == "grow")
+        backpressure = BP_GROW;
+    else
+        return Usage();
+
+    cacheSim = KnobCache.Value();
+    if (cacheSim)
+    {
+        const UINT32 sizes[CACHE_LEVELS] = { KnobL1Size.Value(), KnobL2Size.Value(), KnobLlcSize.Value() };
+        const UINT32 assocs[CACHE_LEVELS] = { KnobL1Assoc.Value(), KnobL2Assoc.Value(), KnobLlcAssoc.Value() };
+        UINT32 line = KnobCacheLine.Value();
+        if (line == 0 || (line & (line - 1)))
+            return Usage();
+        for (cacheLineShift = 0; (1u << cacheLineShift) < line; cacheLineShift++)
+            ;
+        for (UINT32 l = 0; l < CACHE_LEVELS; l++)
+        {
+            if (assocs[l] == 0 || assocs[l] > 64 || (UINT64)sizes[l] * 1024 % ((UINT64)line * assocs[l]))
+                return Usage();
+            cacheAssoc[l] = assocs[l];
+            cacheSets[l] = (UINT32)((UINT64)sizes[l] * 1024 / ((UINT64)line * assocs[l]));
+            if (cacheSets[l] == 0 || (cacheSets[l] & (cacheSets[l] - 1)))
+                return Usage();
+        }
+        if (KnobCachePolicy.Value() == "lru")
+            cachePolicy = POLICY_LRU;
+        else if (KnobCachePolicy.Value() == "plru")
+            cachePolicy = POLICY_PLRU;
+        else
+            return Usage();
+        // Tree PLRU needs a power of two ways
+        for (UINT32 l = 0; cachePolicy == POLICY_PLRU && l < CACHE_LEVELS; l++)
+        {
+            if (cacheAssoc[l] & (cacheAssoc[l] - 1))
+                return Usage();
+        }
+    }
+
+    cct = !KnobCct.Value().empty();
+
+    // -footprint, -cache and -verify replace the recording, so there is
+    // no trace file
+    footprint = KnobFootprint.Value();
+    loadValues = KnobLoadValues.Value();
+    vregBytes = KnobVectorRegs.Value() ? VectorRegBytes() : 0;
+    PIN_InitLock(&verifyLock);
+    if (!KnobVerify.Value().empty())
+    {
+        if (!ReadVerifyChunks(KnobVerify.Value()))
+        {
+            cerr << KnobVerify.Value() << " is not a MyPinTool recording of version " << TRACE_VERSION << endl;
+            return -1;
+        }
+        if (vregBytes > VectorRegBytes())
+        {
+            cerr << KnobVerify.Value() << " has wider vector registers than this machine" << endl;
+            return -1;
+        }
+        verifying = true;
+        stampClock = STAMP_NONE;
+        stampEvents = 0;
+    }
+    numVregs = vregBytes == 64 ? NUM_TRACE_VREG : vregBytes ? 16 : 0;
+
+    if (!footprint && !cacheSim && !verifying)
+    {
+        TRACE_HEADER header;
+        memset(&header, 0, sizeof(header));
+        strncpy(header._magic, TRACE_MAGIC, sizeof(header._magic));
+        header._version = TRACE_VERSION;
+        header._recordSize = sizeof(TRACE_RECORD);
+        header._flags = loadValues ? TRACE_LOAD_VALUES : 0;
+        header._vregBytes = vregBytes;
+        traceFile.open(KnobTraceFile.Value().c_str(), ios::out | ios::binary);
+        traceFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        traceOffset = sizeof(header);
+
+        INDEX_HEADER indexHeader;
+        memset(&indexHeader, 0, sizeof(indexHeader));
+        strncpy(indexHeader._magic, INDEX_MAGIC, sizeof(indexHeader._magic));
+        indexHeader._version = TRACE_VERSION;
+        indexHeader._entrySize = sizeof(INDEX_ENTRY);
+        indexFile.open((KnobTraceFile.Value() + ".idx").c_str(), ios::out | ios::binary);
+        indexFile.write(reinterpret_cast<const char *>(&indexHeader), sizeof(indexHeader));
+    }
+    lastCheckpointMs = NowMs();
+    startMs = lastCheckpointMs;
+    nextHeartbeatMs = startMs + KnobHeartbeatMs.Value();
+
+    PIN_InitLock(&traceLock);
+    PIN_InitLock(&threadsLock);
+    PIN_InitLock(&roiLock);
+    PIN_InitLock(&bbvLock);
+    tdReg = PIN_ClaimToolRegister();
+    PIN_SemaphoreInit(&writerSem);
+
+    // With any ROI knob given, recording waits for the ROI to start
+    skipLeft = KnobSkip.Value();
+    if (skipLeft > 0 || !KnobRoiStart.Value().empty() || !KnobRoiRtn.Value().empty())
+        recording = false;
+
+    if (KnobInterval.Value() == 0) return Usage();
+    if (!KnobBbv.Value().empty())
+    {
+        bbvFile.open(KnobBbv.Value().c_str());
+        recording = false;
+        intervals = true;
+    }
+    if (!KnobSimPoints.Value().empty())
+    {
+        if (!ReadSimPoints(KnobSimPoints.Value()))
+        {
+            cerr << "cannot read simulation points from " << KnobSimPoints.Value() << endl;
+            return -1;
+        }
+        recording = false;
+        intervals = true;
+    }
+    gated = sampling || !SimPoints.empty();
+    tlsKey = PIN_CreateThreadDataKey(0);
+
     // Register Routine to be called to instrument rtn
     RTN_AddInstrumentFunction(Routine, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
+
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    if (KnobSyscalls.Value())
+    {
+        PIN_AddSyscallEntryFunction(SyscallEntry, 0);
+        PIN_AddSyscallExitFunction(SyscallExit, 0);
+        IMG_AddInstrumentFunction(ImageLoad, 0);
+    }
+
+    // Without the writer thread, threads write their own buffers
+    writerRunning = PIN_SpawnInternalThread(WriterThread, 0, 0, &writerUid) != INVALID_THREADID;
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
 
     // Register Fini to be called when the application exits
     PIN_AddFiniFunction(Fini, 0);
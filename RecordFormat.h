@@ -0,0 +1,185 @@
+//
+// Binary layout of the recording written by MyPinTool and read back by
+// the offline tools. Only fixed-width types are used so that the file
+// can be read on any host without Pin.
+//
+
+#ifndef RECORD_FORMAT_H
+#define RECORD_FORMAT_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "RRTRACE"
+#define TRACE_VERSION 11
+
+// Kinds of TRACE_RECORD
+enum RecordKind
+{
+    REC_READ = 0,       // _ip reads _size bytes at _ea
+    REC_WRITE = 1,      // _ip writes _size bytes at _ea
+    REC_VALUE = 2,      // memory at _ea now holds the low _size bytes of _value
+    REC_REG = 3,        // register number _size now holds _value
+    REC_RTN_ENTER = 4,  // routine at _ip is entered
+    REC_RTN_EXIT = 5,   // routine at _ip is left
+
+    // Only found in checkpoint chunks, see CHECKPOINT_TID
+    REC_CHECKPOINT = 6, // checkpoint number _value, taken after _ea events;
+                        // _size is 1 for a keyframe
+    REC_CKPT_THREAD = 7,// thread _size had replayed _value events at routine depth _ea;
+                        // its NUM_TRACE_GR REC_REG records follow, then
+                        // REC_VREG records for its nonzero vector quadwords
+    REC_CKPT_PAGE = 8,  // the page of memory at _ea follows, CKPT_PAGE_RECORDS
+                        // records of raw data: its _size bytes, then a bit
+                        // per byte saying whether the recording stored it.
+                        // _value is 0 for the image of all threads, else 1
+                        // + the thread whose own REC_VALUE records it holds
+
+    REC_SYSCALL = 9,    // the syscall instruction at _ip ran system call _size,
+                        // which returned _ea. What the kernel wrote to user
+                        // memory follows as REC_WRITE/REC_VALUE records of _ip.
+                        // For the time calls the vDSO answers, _ip is the
+                        // vDSO routine
+    REC_STAMP = 10,     // global ordering stamp _value, see below
+    REC_VREG = 11,      // bytes [_ea, _ea + 8) of vector register _size now hold _value
+    REC_GAP = 12        // _value records of the thread were dropped here, which
+                        // left it at routine depth _ea. Its registers are
+                        // unknown until recorded again, and its logged load
+                        // values start over
+};
+
+// Every thread's events carry REC_STAMP records: at thread start, at
+// synchronization points and every so many events. An event has the
+// stamp of the last REC_STAMP before it in its thread. If an event
+// happened before an event of another thread, through memory or a
+// system call, its stamp is smaller; merging threads by stamp, ties in
+// any order, gives an order consistent with their synchronization
+enum StampClock
+{
+    STAMP_NONE = 0,
+    STAMP_LOGICAL = 1,  // a Lamport clock per thread. Threads sync it through
+                        // every load and store and around system calls
+    STAMP_TSC = 2       // the time stamp counter, which must be invariant.
+                        // Stamped around system calls and atomic
+                        // read-modify-writes only, so plain stores that
+                        // release a lock are ordered to the periodic stamps
+};
+
+// Register numbers used by REC_REG, in the order of Pin's REG_GR_BASE
+#define NUM_TRACE_GR 16
+
+static const char * const TraceRegNames[NUM_TRACE_GR] =
+{
+    "rdi", "rsi", "rbp", "rsp", "rbx", "rdx", "rcx", "rax",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+// Vector register numbers used by REC_VREG: xmm, ymm or zmm 0-31 at the
+// width in TRACE_HEADER, then the AVX-512 mask registers k0-k7, eight
+// bytes each. Only the registers the CPU has appear
+#define NUM_TRACE_VREG 40
+#define TRACE_VREG_K0 32
+#define TRACE_VREG_BYTES 64
+
+// Written once at the start of the file
+typedef struct TraceHeader
+{
+    char _magic[8];
+    uint32_t _version;
+    uint32_t _recordSize;
+    uint32_t _flags;            // TRACE_* below
+    uint32_t _vregBytes;        // width of the REC_VREG registers: 16, 32 or 64,
+                                // 0 if vector registers were not recorded
+} TRACE_HEADER;
+
+// The recording logs loads too: REC_VALUE records of a thread also come
+// ahead of its REC_READ, giving the data read, except for bytes its own
+// earlier REC_VALUE records already say. A replay that keeps what each
+// thread's values said has every byte every load read
+#define TRACE_LOAD_VALUES 0x1
+
+// Every drained thread buffer becomes one chunk: the header followed by
+// _bytes bytes holding _count records, all from thread _tid and in
+// program order
+typedef struct ChunkHeader
+{
+    uint32_t _tid;
+    uint32_t _count;
+    uint32_t _bytes;
+    uint32_t _encoding;
+} CHUNK_HEADER;
+
+// How the records of a chunk are stored
+enum ChunkEncoding
+{
+    CHUNK_RAW = 0,      // an array of TRACE_RECORD
+    CHUNK_CODEC = 1     // compressed with CodecEncode, see Codec.h
+};
+
+// A chunk with this _tid is a checkpoint, not events, and is always stored
+// raw. It holds the state a replay has reached at that point in the file:
+// the registers of every thread and the pages stored to since the
+// checkpoint before. A keyframe holds every page stored to so far, so a
+// replay restores the last keyframe and then the checkpoints after it
+#define CHECKPOINT_TID 0xffffffffu
+#define CKPT_PAGE_SIZE 4096
+#define CKPT_PAGE_BYTES (CKPT_PAGE_SIZE + CKPT_PAGE_SIZE / 8)
+#define CKPT_PAGE_RECORDS ((CKPT_PAGE_BYTES + sizeof(TRACE_RECORD) - 1) / sizeof(TRACE_RECORD))
+
+// A single event. A routine's entry registers, as REC_REG and REC_VREG
+// records, follow its REC_RTN_ENTER and its exit registers precede its
+// REC_RTN_EXIT. A REC_VALUE follows the REC_WRITE that produced it and,
+// with TRACE_LOAD_VALUES, precedes the REC_READ that read it
+typedef struct TraceRecord
+{
+    union
+    {
+        uint64_t _ip;
+        uint64_t _value;
+    };
+    uint64_t _ea;
+    uint32_t _size;
+    uint32_t _kind;
+} TRACE_RECORD;
+
+// The recording "x" comes with an index "x.idx": an INDEX_HEADER and one
+// INDEX_ENTRY per chunk, in file order
+#define INDEX_MAGIC "RRINDEX"
+
+typedef struct IndexHeader
+{
+    char _magic[8];
+    uint32_t _version;          // TRACE_VERSION of the recording
+    uint32_t _entrySize;
+} INDEX_HEADER;
+
+// What the records of an event chunk contain, so that a query can skip
+// the chunk without decoding it. The filters may report a page or routine
+// the chunk does not have, never miss one it has. See ChunkSummary.h
+#define SUMMARY_PAGE_SHIFT 12
+#define SUMMARY_EA_WORDS 32     // 2048 bit filter of the pages read or written
+#define SUMMARY_RTN_WORDS 4     // 256 bit filter of the routines entered or left
+
+typedef struct ChunkSummary
+{
+    uint64_t _firstStamp;       // REC_STAMP in effect at the first record, 0 for none
+    uint64_t _lastStamp;        // and at the last one
+    uint64_t _minEa;            // lowest and highest byte read or written;
+    uint64_t _maxEa;            // _minEa > _maxEa if there are none
+    uint64_t _eaFilter[SUMMARY_EA_WORDS];
+    uint64_t _rtnFilter[SUMMARY_RTN_WORDS];
+    uint32_t _kinds;            // bit 1 << kind for every RecordKind present
+    uint32_t _reserved;
+} CHUNK_SUMMARY;
+
+typedef struct IndexEntry
+{
+    uint64_t _event;            // events in the file before this chunk
+    uint64_t _offset;           // file offset of the chunk header
+    uint64_t _icount;           // instructions the thread executed by the end of the chunk
+    uint64_t _rtn;              // routine the thread last entered by the end of the chunk
+    uint32_t _tid;              // as in CHUNK_HEADER
+    uint32_t _count;
+    CHUNK_SUMMARY _summary;     // all zero for checkpoints
+} INDEX_ENTRY;
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Threads contending on a mutex and on an atomic counter, for the cost
+ * of per-thread buffers, the writer thread and the ordering stamps.
+ *
+ * Usage: contention [threads] [iterations per thread]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long shared;
+static unsigned long atomicCount;
+static unsigned long iterations;
+
+static void * Worker(void * arg)
+{
+    unsigned long local = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        __atomic_add_fetch(&atomicCount, 1, __ATOMIC_SEQ_CST);
+        local += i;
+        if (i % 16 == 0)
+        {
+            pthread_mutex_lock(&lock);
+            shared += local;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return arg;
+}
+
+int main(int argc, char * argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    iterations = argc > 2 ? strtoul(argv[2], 0, 0) : 1000000;
+    pthread_t * tids = malloc(threads * sizeof(pthread_t));
+    if (!tids)
+        return 1;
+
+    for (int t = 0; t < threads; t++)
+        pthread_create(&tids[t], 0, Worker, 0);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], 0);
+    printf("%lu %lu\n", shared, atomicCount);
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Pointer chasing through a random cyclic permutation: one dependent
+ * load per step, almost all of them cache misses once the array is
+ * larger than the last level cache.
+ *
+ * Usage: pointer_chase [elements] [steps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char * argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], 0, 0) : 1 << 22;
+    size_t steps = argc > 2 ? strtoul(argv[2], 0, 0) : 1 << 24;
+    size_t * next = malloc(n * sizeof(size_t));
+    if (!next || n < 2)
+        return 1;
+
+    /* Sattolo's algorithm gives a single cycle through all elements */
+    for (size_t i = 0; i < n; i++)
+        next[i] = i;
+    srand(1);
+    for (size_t i = n - 1; i > 0; i--)
+    {
+        size_t j = ((size_t)rand() * RAND_MAX + rand()) % i;
+        size_t t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+
+    size_t p = 0;
+    for (size_t s = 0; s < steps; s++)
+        p = next[p];
+    printf("%zu\n", p);
+    free(next);
+    return 0;
+}
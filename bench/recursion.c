@@ -0,0 +1,28 @@
+/*
+ * Call-heavy recursion: tiny routines called millions of times, which is
+ * where per-routine entry and exit instrumentation dominates.
+ *
+ * Usage: recursion [n]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((noinline)) static unsigned long leaf(unsigned long x)
+{
+    return x * 2654435761u;
+}
+
+__attribute__((noinline)) static unsigned long fib(unsigned n)
+{
+    if (n < 2)
+        return leaf(n);
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main(int argc, char * argv[])
+{
+    unsigned n = argc > 1 ? atoi(argv[1]) : 30;
+    printf("%lu\n", fib(n));
+    return 0;
+}
@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Runs every benchmark natively and under every recorder mode and prints
+# one line per run: wall time, slowdown against the native run, trace
+# bytes written per second, peak RSS and the time the tool spent in its
+# own instrumentation callbacks (Pin's JIT is not included).
+#
+# Usage: bench/run.sh [-p pin] [-t tool.so] [-r runs] [-o results.csv] [benchmark...]
+#
+# PIN_ROOT is used to find pin when -p is not given. Each run happens in
+# a scratch directory so that trace files and mypintool.out do not mix.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+TOOL_DIR=$(dirname "$BENCH_DIR")
+PIN=${PIN_ROOT:+$PIN_ROOT/pin}
+TOOL=$TOOL_DIR/obj-intel64/MyPinTool.so
+RUNS=3
+RESULTS=
+
+while getopts "p:t:r:o:" opt; do
+    case $opt in
+        p) PIN=$OPTARG ;;
+        t) TOOL=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        *) sed -n '9p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ -z "$PIN" ] || [ ! -x "$PIN" ]; then
+    echo "pin not found; set PIN_ROOT or pass -p" >&2
+    exit 2
+fi
+if [ ! -f "$TOOL" ]; then
+    echo "$TOOL not found; build the tool first or pass -t" >&2
+    exit 2
+fi
+
+# Name, then arguments sized for a few seconds of native run time
+BENCHMARKS=(
+    "pointer_chase 4194304 16777216"
+    "stream_memcpy 64 8"
+    "recursion 30"
+    "contention 4 1000000"
+    "syscall_io 100000"
+)
+
+# Mode name, then tool switches. record_* write a trace, the others
+# replace recording with their own analysis
+MODES=(
+    "record"
+    "record_raw -compress 0"
+    "record_novalues -values 0"
+    "record_novregs -vector_regs 0"
+    "record_syscalls -syscalls 1"
+    "record_loads -load_values 1"
+    "record_sampled -sample_burst 10000 -sample_period 1000000"
+    "footprint -footprint 1"
+    "cache -cache 1"
+    "bbv -bbv bbv.out"
+    "cct -cct cct.csv"
+)
+
+BUILD=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$BUILD" "$SCRATCH"' EXIT
+
+CC=${CC:-cc}
+$CC -O2 -o "$BUILD/runstat" "$BENCH_DIR/runstat.c"
+for b in "${BENCHMARKS[@]}"; do
+    name=${b%% *}
+    $CC -O2 -g -pthread -o "$BUILD/$name" "$BENCH_DIR/$name.c"
+done
+
+if [ $# -gt 0 ]; then
+    selected=" $* "
+else
+    selected=
+fi
+
+# Best of $RUNS for one configuration; sets TIME, RSS, BYTES and INSTR
+measure() {
+    local best=
+    for ((i = 0; i < RUNS; i++)); do
+        rm -rf "$SCRATCH"/*
+        (cd "$SCRATCH" && "$BUILD/runstat" stat "$@" > /dev/null 2> stderr) || {
+            echo "failed: $*" >&2
+            cat "$SCRATCH/stderr" >&2
+            return 1
+        }
+        read -r time rss < "$SCRATCH/stat"
+        if [ -z "$best" ] || awk "BEGIN { exit !($time < $best) }"; then
+            best=$time
+            RSS=$rss
+            BYTES=$(cat "$SCRATCH"/mypintool.trace "$SCRATCH"/mypintool.trace.idx 2> /dev/null | wc -c)
+            INSTR=$(sed -n 's/^Instrumentation: \([0-9]*\) ms.*/\1/p' "$SCRATCH/mypintool.out" 2> /dev/null || true)
+        fi
+    done
+    TIME=$best
+}
+
+header="benchmark,mode,seconds,slowdown,trace_mb_per_s,peak_rss_mb,instrumentation_ms"
+echo "$header" | tr ',' '\t'
+[ -n "$RESULTS" ] && echo "$header" > "$RESULTS"
+
+report() {
+    local line="$1,$2,$TIME,$3,$4,$(awk "BEGIN { printf \"%.1f\", $RSS / 1024 }"),${INSTR:--}"
+    echo "$line" | tr ',' '\t'
+    [ -n "$RESULTS" ] && echo "$line" >> "$RESULTS"
+    return 0
+}
+
+for b in "${BENCHMARKS[@]}"; do
+    name=${b%% *}
+    args=${b#$name}
+    if [ -n "$selected" ] && [[ $selected != *" $name "* ]]; then
+        continue
+    fi
+
+    measure "$BUILD/$name" $args
+    native=$TIME
+    report "$name" native 1.00 0
+
+    for m in "${MODES[@]}"; do
+        mode=${m%% *}
+        switches=${m#$mode}
+        measure "$PIN" -t "$TOOL" $switches -- "$BUILD/$name" $args
+        slowdown=$(awk "BEGIN { printf \"%.2f\", $TIME / ($native > 0 ? $native : 0.001) }")
+        rate=$(awk "BEGIN { printf \"%.1f\", $BYTES / 1048576 / ($TIME > 0 ? $TIME : 0.001) }")
+        report "$name" "$mode" "$slowdown" "$rate"
+    done
+done
@@ -0,0 +1,52 @@
+/*
+ * Runs a command and writes its wall time in seconds and the peak RSS in
+ * KB of it and every descendant it waited for to a file, so that run.sh
+ * does not depend on GNU time. Exits with the command's status.
+ *
+ * Usage: runstat out-file command [args...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char * argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: runstat out-file command [args...]\n");
+        return 2;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execvp(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+    {
+        perror("runstat");
+        return 2;
+    }
+    gettimeofday(&end, 0);
+
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    FILE * out = fopen(argv[1], "w");
+    if (!out)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+    fprintf(out, "%.3f %ld\n", (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6, usage.ru_maxrss);
+    fclose(out);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,36 @@
+/*
+ * Streaming copies between two large buffers, so that most of the
+ * recorded events are wide loads and stores with sequential addresses.
+ *
+ * Usage: stream_memcpy [megabytes] [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char * argv[])
+{
+    size_t bytes = (argc > 1 ? strtoul(argv[1], 0, 0) : 64) << 20;
+    int passes = argc > 2 ? atoi(argv[2]) : 8;
+    char * a = malloc(bytes);
+    char * b = malloc(bytes);
+    if (!a || !b)
+        return 1;
+
+    memset(a, 1, bytes);
+    for (int p = 0; p < passes; p++)
+    {
+        memcpy(b, a, bytes);
+        b[p % bytes]++;
+        memcpy(a, b, bytes);
+    }
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < bytes; i += 4096)
+        sum += a[i];
+    printf("%lu\n", sum);
+    free(a);
+    free(b);
+    return 0;
+}
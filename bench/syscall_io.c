@@ -0,0 +1,47 @@
+/*
+ * Small reads and writes through a temporary file plus clock and stat
+ * calls, so that system call capture is a large share of the work.
+ *
+ * Usage: syscall_io [iterations]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char * argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    char path[] = "/tmp/syscall_io.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return 1;
+    unlink(path);
+
+    char buf[512];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)i;
+    for (int b = 0; b < 64; b++)
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+            return 1;
+
+    unsigned long sum = 0;
+    for (long i = 0; i < iterations; i++)
+    {
+        struct timespec ts;
+        struct stat st;
+        if (pwrite(fd, buf, sizeof(buf), (i % 64) * sizeof(buf)) != sizeof(buf))
+            return 1;
+        if (pread(fd, buf, sizeof(buf), ((i * 7) % 64) * sizeof(buf)) != sizeof(buf))
+            return 1;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        fstat(fd, &st);
+        sum += buf[i % sizeof(buf)] + st.st_size;
+    }
+    printf("%lu\n", sum);
+    close(fd);
+    return 0;
+}
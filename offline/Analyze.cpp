@@ -0,0 +1,633 @@
+//
+// Per-routine totals of a MyPinTool recording, computed on all cores.
+// Every chunk decodes on its own, so worker threads take chunks from
+// their own share of the file and steal half of another worker's
+// remaining share when theirs runs out. What a chunk cannot attribute by
+// itself, the accesses of the routine that was running when it began,
+// is resolved afterwards by walking each thread's chunks in order with
+// only their call stack changes.
+//
+// Build: g++ -O2 -pthread -o analyze Analyze.cpp
+// Usage: analyze [-j threads] [-top n] [-sort calls|memory] [mypintool.trace]
+//
+// Reported per routine: calls, reads and writes with their bytes, and
+// how often each register held another value at the routine's exit than
+// at its entry. Instruction counts are not in the recording; the .idx
+// gives them per thread.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../RecordFormat.h"
+#include "../Codec.h"
+
+// Routine address for accesses made outside any recorded routine
+#define NO_RTN 0
+
+typedef struct RtnAgg
+{
+    uint64_t _calls;
+    uint64_t _reads;
+    uint64_t _writes;
+    uint64_t _readBytes;
+    uint64_t _writeBytes;
+    uint64_t _regChanges[NUM_TRACE_GR];
+} RTN_AGG;
+
+typedef std::unordered_map<uint64_t, RTN_AGG> AGG_MAP;
+
+typedef struct ChunkRef
+{
+    uint64_t _offset;
+    uint64_t _icount;           // from the index, 0 without one
+    uint32_t _tid;
+} CHUNK_REF;
+
+// Registers as a chunk sees them: the ones in _known were recorded in
+// it, the others still hold what they held when it began
+typedef struct RegState
+{
+    uint32_t _known;
+    uint64_t _vals[NUM_TRACE_GR];
+} REG_STATE;
+
+// Exit of a frame the chunk did not see entered, _frame frames below
+// the incoming top, with the registers at the exit
+typedef struct HeadExit
+{
+    uint64_t _rtn;
+    uint32_t _frame;
+    REG_STATE _regs;
+} HEAD_EXIT;
+
+// Register of a frame the chunk saw entered and exit that was recorded
+// in between but not before: it changed unless it held _value already
+// when the chunk began
+typedef struct DeferredReg
+{
+    uint64_t _rtn;
+    uint32_t _reg;
+    uint64_t _value;
+} DEFERRED_REG;
+
+// What a chunk leaves for the in-order pass: how it changed its thread's
+// call stack and registers, the accesses it made in a routine it never
+// saw exit, and the register comparisons that need the registers it
+// began with
+typedef struct ChunkResult
+{
+    uint32_t _pops;                 // frames of the incoming stack it left
+    std::vector<uint64_t> _pushed;  // routines entered and not left, outermost first
+    std::vector<REG_STATE> _pushedRegs; // and their entry registers
+    RTN_AGG _pending;               // accesses at _pops frames below the incoming top
+    bool _hasPending;
+    bool _gap;                      // it starts with a REC_GAP, which left the
+    uint32_t _gapDepth;             // thread at this depth
+    REG_STATE _headRegs;            // recorded before any other record. Entry
+                                    // registers of the incoming top if the previous
+                                    // chunk ended with its REC_RTN_ENTER
+    bool _headOnly;                 // it has no other records
+    bool _tailEntry;                // it ends with a REC_RTN_ENTER and its registers
+    std::vector<HEAD_EXIT> _headExits;
+    std::vector<DEFERRED_REG> _deferred;
+    REG_STATE _endRegs;
+} CHUNK_RESULT;
+
+// A frame of the in-order pass: the routine and its entry registers
+typedef struct Frame
+{
+    uint64_t _rtn;
+    uint64_t _regs[NUM_TRACE_GR];
+} FRAME;
+
+// One worker's share of the chunks, [_begin, _end)
+typedef struct WorkRange
+{
+    std::mutex _lock;
+    size_t _begin;
+    size_t _end;
+} WORK_RANGE;
+
+static const uint8_t * base;
+static size_t fileSize;
+static std::vector<CHUNK_REF> chunks;
+static std::vector<CHUNK_RESULT> results;
+static std::vector<std::unique_ptr<WORK_RANGE> > ranges;
+static std::mutex errorLock;
+static std::string error;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Fail(const std::string & message)
+{
+    std::lock_guard<std::mutex> guard(errorLock);
+    if (error.empty())
+        error = message;
+}
+
+static const CHUNK_HEADER * ChunkAt(uint64_t offset)
+{
+    if (offset + sizeof(CHUNK_HEADER) > fileSize)
+        return 0;
+    const CHUNK_HEADER * chunk = reinterpret_cast<const CHUNK_HEADER *>(base + offset);
+    if (chunk->_bytes > fileSize - offset - sizeof(CHUNK_HEADER))
+        return 0;
+    return chunk;
+}
+
+// The event chunks in file order, from the index if there is a usable
+// one, else by walking the chunk headers
+static void FindChunks(const std::string & path)
+{
+    FILE * in = fopen((path + ".idx").c_str(), "rb");
+    INDEX_HEADER header;
+    if (in && fread(&header, sizeof(header), 1, in) == 1
+        && strncmp(header._magic, INDEX_MAGIC, sizeof(header._magic)) == 0
+        && header._version == TRACE_VERSION && header._entrySize == sizeof(INDEX_ENTRY))
+    {
+        INDEX_ENTRY entry;
+        while (fread(&entry, sizeof(entry), 1, in) == 1)
+        {
+            // The index may describe a longer file than the one mapped
+            if (!ChunkAt(entry._offset))
+                break;
+            if (entry._tid == CHECKPOINT_TID)
+                continue;
+            CHUNK_REF ref = { entry._offset, entry._icount, entry._tid };
+            chunks.push_back(ref);
+        }
+        fclose(in);
+        return;
+    }
+    if (in)
+        fclose(in);
+
+    uint64_t offset = sizeof(TRACE_HEADER);
+    while (const CHUNK_HEADER * chunk = ChunkAt(offset))
+    {
+        if (chunk->_tid != CHECKPOINT_TID)
+        {
+            CHUNK_REF ref = { offset, 0, chunk->_tid };
+            chunks.push_back(ref);
+        }
+        offset += sizeof(CHUNK_HEADER) + chunk->_bytes;
+    }
+    if (offset != fileSize)
+        Fail("recording is truncated");
+}
+
+static void CountAccess(RTN_AGG * agg, const TRACE_RECORD & rec)
+{
+    if (rec._kind == REC_READ)
+    {
+        agg->_reads++;
+        agg->_readBytes += rec._size;
+    }
+    else
+    {
+        agg->_writes++;
+        agg->_writeBytes += rec._size;
+    }
+}
+
+static void AddRegs(RTN_AGG * agg, uint32_t mask)
+{
+    for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+    {
+        if (mask & (1u << reg))
+            agg->_regChanges[reg]++;
+    }
+}
+
+static void SetReg(REG_STATE * state, uint32_t reg, uint64_t value)
+{
+    state->_known |= 1u << reg;
+    state->_vals[reg] = value;
+}
+
+// The registers of a frame the chunk saw entered that changed by its
+// exit, as far as the chunk knows them; the rest goes to 'deferred'
+static uint32_t ChangedRegs(uint64_t rtn, const REG_STATE & entry, const REG_STATE & exit,
+                            std::vector<DEFERRED_REG> & deferred)
+{
+    uint32_t changed = 0;
+    for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+    {
+        uint32_t bit = 1u << reg;
+        if (!((entry._known | exit._known) & bit))
+            continue;
+        if (entry._known & exit._known & bit)
+        {
+            if (entry._vals[reg] != exit._vals[reg])
+                changed |= bit;
+            continue;
+        }
+        DEFERRED_REG d = { rtn, reg, exit._known & bit ? exit._vals[reg] : entry._vals[reg] };
+        deferred.push_back(d);
+    }
+    return changed;
+}
+
+// The registers of a chunk's state, given those it began with
+static void Resolve(const REG_STATE & state, const uint64_t * incoming, uint64_t * regs)
+{
+    for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+        regs[reg] = state._known & (1u << reg) ? state._vals[reg] : incoming[reg];
+}
+
+static void AddAgg(RTN_AGG * to, const RTN_AGG & from)
+{
+    to->_calls += from._calls;
+    to->_reads += from._reads;
+    to->_writes += from._writes;
+    to->_readBytes += from._readBytes;
+    to->_writeBytes += from._writeBytes;
+    for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+        to->_regChanges[reg] += from._regChanges[reg];
+}
+
+// Aggregate one chunk into rtns, with a call stack that starts empty.
+// Entry registers follow their REC_RTN_ENTER and belong in its snapshot
+static void AnalyzeChunk(const TRACE_RECORD * recs, uint32_t count, AGG_MAP & rtns, CHUNK_RESULT * result)
+{
+    std::vector<uint64_t> & stack = result->_pushed;
+    std::vector<REG_STATE> & entryRegs = result->_pushedRegs;
+    REG_STATE & regs = result->_endRegs;
+    bool head = true;
+    bool entering = false;
+    for (const TRACE_RECORD * rec = recs; rec < recs + count; rec++)
+    {
+        if (rec->_kind == REC_REG || rec->_kind == REC_VREG)
+        {
+            if (rec->_kind != REC_REG || rec->_size >= NUM_TRACE_GR)
+                continue;
+            SetReg(&regs, rec->_size, rec->_value);
+            if (head)
+                SetReg(&result->_headRegs, rec->_size, rec->_value);
+            if (entering && !entryRegs.empty())
+                entryRegs.back() = regs;
+            continue;
+        }
+        head = false;
+        entering = false;
+
+        switch (rec->_kind)
+        {
+          case REC_GAP:
+            // The tool only writes one at the start of a chunk
+            if (rec == recs)
+            {
+                result->_gap = true;
+                result->_gapDepth = rec->_ea;
+            }
+            break;
+          case REC_RTN_ENTER:
+            rtns[rec->_ip]._calls++;
+            stack.push_back(rec->_ip);
+            entryRegs.push_back(regs);
+            entering = true;
+            break;
+          case REC_RTN_EXIT:
+            if (!stack.empty())
+            {
+                uint32_t changed = ChangedRegs(rec->_ip, entryRegs.back(), regs, result->_deferred);
+                if (changed)
+                    AddRegs(&rtns[rec->_ip], changed);
+                stack.pop_back();
+                entryRegs.pop_back();
+            }
+            else
+            {
+                // Its entry registers are in an earlier chunk
+                HEAD_EXIT exit = { rec->_ip, result->_pops, regs };
+                result->_headExits.push_back(exit);
+
+                // The exit names the incoming frame the pending accesses
+                // belong to
+                if (result->_hasPending)
+                    AddAgg(&rtns[rec->_ip], result->_pending);
+                memset(&result->_pending, 0, sizeof(result->_pending));
+                result->_hasPending = false;
+                result->_pops++;
+            }
+            break;
+          case REC_READ:
+          case REC_WRITE:
+            if (!stack.empty())
+            {
+                CountAccess(&rtns[stack.back()], *rec);
+            }
+            else
+            {
+                CountAccess(&result->_pending, *rec);
+                result->_hasPending = true;
+            }
+            break;
+          default:
+            break;
+        }
+    }
+    result->_headOnly = head;
+    result->_tailEntry = entering;
+}
+
+static bool DecodeChunk(const CHUNK_REF & ref, CODEC_STATE * codec, std::vector<TRACE_RECORD> & decoded,
+                        const TRACE_RECORD ** recs, uint32_t * count)
+{
+    const CHUNK_HEADER * chunk = ChunkAt(ref._offset);
+    const uint8_t * payload = reinterpret_cast<const uint8_t *>(chunk + 1);
+    *count = chunk->_count;
+    if (chunk->_encoding == CHUNK_RAW && chunk->_bytes == static_cast<size_t>(chunk->_count) * sizeof(TRACE_RECORD))
+    {
+        *recs = reinterpret_cast<const TRACE_RECORD *>(payload);
+        return true;
+    }
+    decoded.resize(chunk->_count);
+    if (chunk->_encoding != CHUNK_CODEC || !CodecDecode(codec, payload, chunk->_bytes, decoded.data(), chunk->_count))
+        return false;
+    *recs = decoded.data();
+    return true;
+}
+
+// Next chunk of worker w: the front of its own range, else half of the
+// back of the first other range that has any left
+static bool NextChunk(size_t w, size_t * index)
+{
+    WORK_RANGE & own = *ranges[w];
+    {
+        std::lock_guard<std::mutex> guard(own._lock);
+        if (own._begin < own._end)
+        {
+            *index = own._begin++;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        WORK_RANGE & victim = *ranges[(w + i) % ranges.size()];
+        size_t begin, end;
+        {
+            std::lock_guard<std::mutex> guard(victim._lock);
+            if (victim._begin >= victim._end)
+                continue;
+            size_t n = (victim._end - victim._begin + 1) / 2;
+            end = victim._end;
+            begin = end - n;
+            victim._end = begin;
+        }
+        std::lock_guard<std::mutex> guard(own._lock);
+        own._begin = begin + 1;
+        own._end = end;
+        *index = begin;
+        return true;
+    }
+    return false;
+}
+
+static void Worker(size_t w, AGG_MAP * rtns)
+{
+    std::unique_ptr<CODEC_STATE> codec(new CODEC_STATE);
+    std::vector<TRACE_RECORD> decoded;
+    size_t index;
+    while (NextChunk(w, &index))
+    {
+        const TRACE_RECORD * recs;
+        uint32_t count;
+        if (!DecodeChunk(chunks[index], codec.get(), decoded, &recs, &count))
+        {
+            Fail("corrupt chunk at offset " + std::to_string(chunks[index]._offset));
+            return;
+        }
+        AnalyzeChunk(recs, count, *rtns, &results[index]);
+    }
+}
+
+// Walk every thread's chunks in order, with their real call stacks and
+// registers, charge what each chunk left pending to the routine it
+// belongs to, and finish the register comparisons it could not make.
+// Registers never recorded hold 0, as the tool starts from 0
+static void ResolvePending(AGG_MAP & rtns)
+{
+    typedef struct ThreadPass
+    {
+        std::vector<FRAME> _stack;
+        uint64_t _regs[NUM_TRACE_GR];
+        bool _entering;
+    } THREAD_PASS;
+    std::unordered_map<uint32_t, THREAD_PASS> threads;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        const CHUNK_RESULT & r = results[i];
+        std::unordered_map<uint32_t, THREAD_PASS>::iterator found = threads.find(chunks[i]._tid);
+        if (found == threads.end())
+        {
+            found = threads.insert(std::make_pair(chunks[i]._tid, THREAD_PASS())).first;
+            memset(found->second._regs, 0, sizeof(found->second._regs));
+            found->second._entering = false;
+        }
+        THREAD_PASS & t = found->second;
+        std::vector<FRAME> & stack = t._stack;
+
+        // Frames entered in the gap compare against the state after it
+        if (r._gap)
+        {
+            FRAME unknown;
+            unknown._rtn = NO_RTN;
+            memcpy(unknown._regs, t._regs, sizeof(t._regs));
+            stack.resize(r._gapDepth, unknown);
+            t._entering = false;
+        }
+
+        // Registers at the head of the chunk may be the entry registers
+        // of the frame the previous chunk ended with
+        if (t._entering && !stack.empty())
+            Resolve(r._headRegs, stack.back()._regs, stack.back()._regs);
+
+        for (size_t e = 0; e < r._headExits.size(); e++)
+        {
+            const HEAD_EXIT & exit = r._headExits[e];
+            if (stack.size() <= exit._frame)
+                continue;
+            const FRAME & frame = stack[stack.size() - 1 - exit._frame];
+            uint64_t regs[NUM_TRACE_GR];
+            Resolve(exit._regs, t._regs, regs);
+            uint32_t changed = 0;
+            for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+            {
+                if (regs[reg] != frame._regs[reg])
+                    changed |= 1u << reg;
+            }
+            if (changed)
+                AddRegs(&rtns[exit._rtn], changed);
+        }
+        for (size_t d = 0; d < r._deferred.size(); d++)
+        {
+            if (t._regs[r._deferred[d]._reg] != r._deferred[d]._value)
+                rtns[r._deferred[d]._rtn]._regChanges[r._deferred[d]._reg]++;
+        }
+
+        if (r._hasPending)
+        {
+            uint64_t rtn = stack.size() > r._pops ? stack[stack.size() - 1 - r._pops]._rtn : NO_RTN;
+            AddAgg(&rtns[rtn], r._pending);
+        }
+        stack.resize(stack.size() > r._pops ? stack.size() - r._pops : 0);
+        for (size_t p = 0; p < r._pushed.size(); p++)
+        {
+            FRAME frame;
+            frame._rtn = r._pushed[p];
+            Resolve(r._pushedRegs[p], t._regs, frame._regs);
+            stack.push_back(frame);
+        }
+
+        Resolve(r._endRegs, t._regs, t._regs);
+        if (!r._headOnly)
+            t._entering = r._tailEntry;
+    }
+}
+
+static uint64_t Memory(const RTN_AGG & agg)
+{
+    return agg._reads + agg._writes;
+}
+
+int main(int argc, char * argv[])
+{
+    size_t workers = std::thread::hardware_concurrency();
+    size_t top = 20;
+    bool byMemory = false;
+    const char * name = "mypintool.trace";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            workers = strtoul(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "-top") && i + 1 < argc)
+            top = strtoul(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "-sort") && i + 1 < argc)
+            byMemory = !strcmp(argv[++i], "memory");
+        else
+            name = argv[i];
+    }
+    if (workers == 0)
+        workers = 1;
+
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TRACE_HEADER))
+    {
+        fprintf(stderr, "cannot open %s\n", name);
+        return 1;
+    }
+    fileSize = st.st_size;
+    void * map = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "cannot map %s\n", name);
+        return 1;
+    }
+    base = static_cast<const uint8_t *>(map);
+    const TRACE_HEADER * header = reinterpret_cast<const TRACE_HEADER *>(base);
+    if (strncmp(header->_magic, TRACE_MAGIC, sizeof(header->_magic)) != 0
+        || header->_version != TRACE_VERSION || header->_recordSize != sizeof(TRACE_RECORD))
+    {
+        fprintf(stderr, "%s is not a MyPinTool recording of version %d\n", name, TRACE_VERSION);
+        return 1;
+    }
+
+    double start = Now();
+    FindChunks(name);
+    results.resize(chunks.size());
+    for (size_t w = 0; w < workers; w++)
+    {
+        ranges.push_back(std::unique_ptr<WORK_RANGE>(new WORK_RANGE));
+        ranges[w]->_begin = chunks.size() * w / workers;
+        ranges[w]->_end = chunks.size() * (w + 1) / workers;
+    }
+
+    std::vector<AGG_MAP> partial(workers);
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++)
+        threads.push_back(std::thread(Worker, w, &partial[w]));
+    for (size_t w = 0; w < workers; w++)
+        threads[w].join();
+    if (!error.empty())
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    AGG_MAP rtns;
+    for (size_t w = 0; w < workers; w++)
+    {
+        for (AGG_MAP::const_iterator it = partial[w].begin(); it != partial[w].end(); ++it)
+            AddAgg(&rtns[it->first], it->second);
+    }
+    ResolvePending(rtns);
+
+    std::vector<std::pair<uint64_t, RTN_AGG> > sorted(rtns.begin(), rtns.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [byMemory](const std::pair<uint64_t, RTN_AGG> & a, const std::pair<uint64_t, RTN_AGG> & b)
+              {
+                  uint64_t ka = byMemory ? Memory(a.second) : a.second._calls;
+                  uint64_t kb = byMemory ? Memory(b.second) : b.second._calls;
+                  return ka != kb ? ka > kb : a.first < b.first;
+              });
+    size_t shown = top && top < sorted.size() ? top : sorted.size();
+
+    printf("%18s %12s %12s %12s %12s %12s\n", "Address", "Calls", "Reads", "Writes", "Read Bytes", "Write Bytes");
+    for (size_t i = 0; i < shown; i++)
+    {
+        const RTN_AGG & a = sorted[i].second;
+        printf("%18" PRIx64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+               sorted[i].first, a._calls, a._reads, a._writes, a._readBytes, a._writeBytes);
+    }
+    if (sorted.size() > shown)
+        printf("... %zu more routines\n", sorted.size() - shown);
+
+    printf("\nRegisters changed at exit:\n");
+    for (size_t i = 0; i < shown; i++)
+    {
+        const RTN_AGG & a = sorted[i].second;
+        printf("%18" PRIx64, sorted[i].first);
+        for (uint32_t reg = 0; reg < NUM_TRACE_GR; reg++)
+        {
+            if (a._regChanges[reg])
+                printf(" %s %" PRIu64, TraceRegNames[reg], a._regChanges[reg]);
+        }
+        printf("\n");
+    }
+
+    // Per thread instruction counts, as of each thread's last chunk
+    std::vector<std::pair<uint32_t, uint64_t> > icounts;
+    std::unordered_map<uint32_t, uint64_t> lastIcount;
+    for (size_t i = 0; i < chunks.size(); i++)
+        lastIcount[chunks[i]._tid] = chunks[i]._icount;
+    icounts.assign(lastIcount.begin(), lastIcount.end());
+    std::sort(icounts.begin(), icounts.end());
+    printf("\n%8s %16s\n", "Thread", "Instructions");
+    for (size_t i = 0; i < icounts.size(); i++)
+        printf("%8" PRIu32 " %16" PRIu64 "\n", icounts[i].first, icounts[i].second);
+
+    fprintf(stderr, "analyzed %zu chunks on %zu threads in %.3f s\n", chunks.size(), workers, Now() - start);
+    return 0;
+}
@@ -0,0 +1,76 @@
+//
+// Replays a MyPinTool recording up to a given event and prints the
+// reconstructed register file of every thread and the size of the
+// memory image.
+//
+// Build: g++ -O2 -o replay Replay.cpp Replayer.cpp
+// Usage: replay [mypintool.trace] [event]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include "Replayer.h"
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[])
+{
+    const char * name = argc > 1 ? argv[1] : "mypintool.trace";
+    uint64_t target = argc > 2 ? strtoull(argv[2], 0, 0) : UINT64_MAX;
+
+    Replayer replayer;
+    if (!replayer.Open(name))
+    {
+        fprintf(stderr, "%s\n", replayer.Error().c_str());
+        return 1;
+    }
+
+    double start = Now();
+    const REPLAY_STATE & state = replayer.StateAt(target);
+    double elapsed = Now() - start;
+
+    if (!replayer.Error().empty())
+        fprintf(stderr, "%s\n", replayer.Error().c_str());
+
+    printf("State after %" PRIu64 " events\n", replayer.Position());
+    for (size_t tid = 0; tid < state._threads.size(); tid++)
+    {
+        const THREAD_STATE & ts = state._threads[tid];
+        if (!ts._seen)
+            continue;
+        printf("===============================================\n");
+        printf("Thread %zu: %" PRIu64 " events, routine depth %" PRIu32 "\n", tid, ts._events, ts._depth);
+        for (int reg = 0; reg < NUM_TRACE_GR; reg++)
+            printf("%s\t0x%016" PRIx64 "\n", TraceRegNames[reg], ts._regs[reg]);
+
+        // Vector registers only if they are not all zero
+        for (uint32_t idx = 0; idx < NUM_TRACE_VREG && replayer.VregBytes(); idx++)
+        {
+            uint32_t bytes = idx >= TRACE_VREG_K0 ? sizeof(uint64_t) : replayer.VregBytes();
+            uint32_t i = 0;
+            while (i < bytes && !ts._vregs[idx][i])
+                i++;
+            if (i == bytes)
+                continue;
+            if (idx >= TRACE_VREG_K0)
+                printf("k%" PRIu32 "\t0x", idx - TRACE_VREG_K0);
+            else
+                printf("%cmm%" PRIu32 "\t0x", bytes == 64 ? 'z' : bytes == 32 ? 'y' : 'x', idx);
+            for (i = bytes; i > 0; i--)
+                printf("%02x", ts._vregs[idx][i - 1]);
+            printf("\n");
+        }
+    }
+    printf("===============================================\n");
+    printf("Memory image: %zu pages\n", state._memory.NumPages());
+
+    fprintf(stderr, "replayed %" PRIu64 " events in %.3f s\n", replayer.Position(), elapsed);
+    return 0;
+}
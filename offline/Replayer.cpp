@@ -0,0 +1,508 @@
+//
+// Implementation of the streaming replayer, see Replayer.h
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Replayer.h"
+
+/* ===================================================================== */
+// SparseMemory
+/* ===================================================================== */
+
+void SparseMemory::Write(uint64_t addr, const void * data, size_t size)
+{
+    const uint8_t * src = static_cast<const uint8_t *>(data);
+    while (size > 0)
+    {
+        uint64_t off = addr % REPLAY_PAGE_SIZE;
+        size_t n = REPLAY_PAGE_SIZE - off < size ? REPLAY_PAGE_SIZE - off : size;
+
+        // operator[] value-initializes new pages, so nothing is known yet
+        MEMORY_PAGE & page = _pages[addr / REPLAY_PAGE_SIZE];
+        memcpy(page._data + off, src, n);
+        for (size_t i = off; i < off + n; i++)
+            page._known[i / 8] |= 1 << (i % 8);
+
+        addr += n;
+        src += n;
+        size -= n;
+    }
+}
+
+void SparseMemory::WritePage(uint64_t addr, const uint8_t * data, const uint8_t * known)
+{
+    MEMORY_PAGE & page = _pages[addr / REPLAY_PAGE_SIZE];
+    for (size_t i = 0; i < REPLAY_PAGE_SIZE; i++)
+    {
+        if (known[i / 8] & (1 << (i % 8)))
+            page._data[i] = data[i];
+    }
+    for (size_t i = 0; i < REPLAY_PAGE_SIZE / 8; i++)
+        page._known[i] |= known[i];
+}
+
+bool SparseMemory::Read(uint64_t addr, void * data, size_t size) const
+{
+    uint8_t * dst = static_cast<uint8_t *>(data);
+    bool complete = true;
+    while (size > 0)
+    {
+        uint64_t off = addr % REPLAY_PAGE_SIZE;
+        size_t n = REPLAY_PAGE_SIZE - off < size ? REPLAY_PAGE_SIZE - off : size;
+
+        std::unordered_map<uint64_t, MEMORY_PAGE>::const_iterator it = _pages.find(addr / REPLAY_PAGE_SIZE);
+        if (it == _pages.end())
+        {
+            memset(dst, 0, n);
+            complete = false;
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                size_t b = off + i;
+                if (it->second._known[b / 8] & (1 << (b % 8)))
+                {
+                    dst[i] = it->second._data[b];
+                }
+                else
+                {
+                    dst[i] = 0;
+                    complete = false;
+                }
+            }
+        }
+
+        addr += n;
+        dst += n;
+        size -= n;
+    }
+    return complete;
+}
+
+/* ===================================================================== */
+// Replayer
+/* ===================================================================== */
+
+Replayer::Replayer() : _fd(-1), _base(0), _size(0), _offset(0), _cur(0), _left(0), _tid(0), _next(0),
+    _loadValues(false), _vregBytes(0), _codec(new CODEC_STATE)
+{
+}
+
+Replayer::~Replayer()
+{
+    Close();
+}
+
+bool Replayer::Open(const std::string & path)
+{
+    Close();
+
+    _fd = open(path.c_str(), O_RDONLY);
+    if (_fd < 0)
+    {
+        _error = "cannot open " + path;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TRACE_HEADER))
+    {
+        _error = path + " is not a MyPinTool recording";
+        Close();
+        return false;
+    }
+    _size = st.st_size;
+
+    void * map = mmap(0, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        _error = "cannot map " + path;
+        Close();
+        return false;
+    }
+    _base = static_cast<const uint8_t *>(map);
+    madvise(map, _size, MADV_SEQUENTIAL);
+
+    const TRACE_HEADER * header = reinterpret_cast<const TRACE_HEADER *>(_base);
+    if (strncmp(header->_magic, TRACE_MAGIC, sizeof(header->_magic)) != 0
+        || header->_version != TRACE_VERSION
+        || header->_recordSize != sizeof(TRACE_RECORD))
+    {
+        _error = path + " is not a MyPinTool recording of version " + std::to_string(TRACE_VERSION);
+        Close();
+        return false;
+    }
+    _loadValues = (header->_flags & TRACE_LOAD_VALUES) != 0;
+    _vregBytes = header->_vregBytes <= TRACE_VREG_BYTES ? header->_vregBytes : TRACE_VREG_BYTES;
+
+    FindCheckpoints(path);
+    Rewind();
+    return true;
+}
+
+void Replayer::Close()
+{
+    if (_base)
+        munmap(const_cast<uint8_t *>(_base), _size);
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+    _base = 0;
+    _size = 0;
+    _checkpoints.clear();
+}
+
+void Replayer::Rewind()
+{
+    _offset = sizeof(TRACE_HEADER);
+    _cur = 0;
+    _left = 0;
+    _tid = 0;
+    _next = 0;
+    _state._threads.clear();
+    _state._memory.Clear();
+    _state._views.clear();
+}
+
+// Header of the chunk at offset if it and its payload are all in the
+// file, else 0
+const CHUNK_HEADER * Replayer::ChunkAt(size_t offset) const
+{
+    if (offset + sizeof(CHUNK_HEADER) > _size)
+        return 0;
+    const CHUNK_HEADER * chunk = reinterpret_cast<const CHUNK_HEADER *>(_base + offset);
+    if (chunk->_bytes > _size - offset - sizeof(CHUNK_HEADER))
+        return 0;
+    return chunk;
+}
+
+// Step over the next chunk header, and over checkpoints, which are not
+// events. Returns false at the end of the file or if the last chunk was
+// cut short or cannot be decoded
+bool Replayer::NextChunk()
+{
+    if (_offset + sizeof(CHUNK_HEADER) > _size)
+        return false;
+    const CHUNK_HEADER * chunk = ChunkAt(_offset);
+    if (!chunk)
+    {
+        _error = "recording is truncated";
+        return false;
+    }
+    const uint8_t * payload = _base + _offset + sizeof(CHUNK_HEADER);
+    _offset += sizeof(CHUNK_HEADER) + chunk->_bytes;
+    if (chunk->_tid == CHECKPOINT_TID)
+        return true;
+
+    if (chunk->_encoding == CHUNK_RAW && chunk->_bytes == static_cast<size_t>(chunk->_count) * sizeof(TRACE_RECORD))
+    {
+        _cur = reinterpret_cast<const TRACE_RECORD *>(payload);
+    }
+    else if (chunk->_encoding == CHUNK_CODEC)
+    {
+        _decoded.resize(chunk->_count);
+        if (!CodecDecode(_codec.get(), payload, chunk->_bytes, _decoded.data(), chunk->_count))
+        {
+            _error = "corrupt chunk at offset " + std::to_string(payload - _base - sizeof(CHUNK_HEADER));
+            return false;
+        }
+        _cur = _decoded.data();
+    }
+    else
+    {
+        _error = "unknown chunk encoding at offset " + std::to_string(payload - _base - sizeof(CHUNK_HEADER));
+        return false;
+    }
+    _tid = chunk->_tid;
+    _left = chunk->_count;
+    return true;
+}
+
+bool Replayer::NextEvent(REPLAY_EVENT * ev)
+{
+    while (_left == 0)
+    {
+        if (!NextChunk())
+            return false;
+    }
+
+    ev->_index = _next++;
+    ev->_tid = _tid;
+    ev->_rec = _cur++;
+    _left--;
+
+    Apply(*ev);
+    return true;
+}
+
+THREAD_STATE & Replayer::Thread(uint32_t tid)
+{
+    if (tid >= _state._threads.size())
+    {
+        THREAD_STATE blank;
+        memset(&blank, 0, sizeof(blank));
+        _state._threads.resize(tid + 1, blank);
+    }
+    return _state._threads[tid];
+}
+
+void Replayer::Apply(const REPLAY_EVENT & ev)
+{
+    THREAD_STATE & ts = Thread(ev._tid);
+    ts._seen = true;
+    ts._events++;
+
+    const TRACE_RECORD * rec = ev._rec;
+    switch (rec->_kind)
+    {
+      case REC_VALUE:
+        if (rec->_size > sizeof(rec->_value))
+            break;
+        _state._memory.Write(rec->_ea, &rec->_value, rec->_size);
+        if (_loadValues)
+        {
+            if (ev._tid >= _state._views.size())
+                _state._views.resize(ev._tid + 1);
+            _state._views[ev._tid].Write(rec->_ea, &rec->_value, rec->_size);
+        }
+        break;
+      case REC_REG:
+        if (rec->_size < NUM_TRACE_GR)
+            ts._regs[rec->_size] = rec->_value;
+        break;
+      case REC_VREG:
+        if (rec->_size < NUM_TRACE_VREG && rec->_ea <= TRACE_VREG_BYTES - sizeof(rec->_value))
+            memcpy(ts._vregs[rec->_size] + rec->_ea, &rec->_value, sizeof(rec->_value));
+        break;
+      case REC_RTN_ENTER:
+        ts._depth++;
+        break;
+      case REC_RTN_EXIT:
+        if (ts._depth > 0)
+            ts._depth--;
+        break;
+      case REC_STAMP:
+        ts._stamp = rec->_value;
+        break;
+      case REC_GAP:
+        ts._depth = rec->_ea;
+        if (ev._tid < _state._views.size())
+            _state._views[ev._tid].Clear();
+        break;
+      default:
+        break;
+    }
+}
+
+bool Replayer::ReadAs(uint32_t tid, uint64_t addr, void * data, size_t size) const
+{
+    bool complete = _state._memory.Read(addr, data, size);
+    if (tid >= _state._views.size())
+        return complete;
+
+    // Byte by byte, since either image may know what the other does not
+    const SparseMemory & view = _state._views[tid];
+    uint8_t * dst = static_cast<uint8_t *>(data);
+    complete = true;
+    for (size_t i = 0; i < size; i++)
+    {
+        uint8_t byte;
+        if (view.Read(addr + i, &byte, 1))
+            dst[i] = byte;
+        else if (!_state._memory.Read(addr + i, &byte, 1))
+            complete = false;
+    }
+    return complete;
+}
+
+/* ===================================================================== */
+// Checkpoints
+/* ===================================================================== */
+
+// Checkpoints are read in place, so only raw ones are usable
+static bool IsCheckpoint(const CHUNK_HEADER * chunk)
+{
+    return chunk->_tid == CHECKPOINT_TID && chunk->_encoding == CHUNK_RAW
+        && chunk->_bytes == static_cast<size_t>(chunk->_count) * sizeof(TRACE_RECORD);
+}
+
+// The REC_CHECKPOINT a checkpoint chunk starts with
+const TRACE_RECORD * Replayer::CheckpointRecord(const INDEX_ENTRY & cp) const
+{
+    const TRACE_RECORD * rec = reinterpret_cast<const TRACE_RECORD *>(_base + cp._offset + sizeof(CHUNK_HEADER));
+    return cp._count && rec->_kind == REC_CHECKPOINT ? rec : 0;
+}
+
+void Replayer::FindCheckpoints(const std::string & path)
+{
+    _checkpoints.clear();
+    if (ReadIndex(path + ".idx"))
+    {
+        DropUnreachable();
+        return;
+    }
+
+    // No usable index, the chunk headers give the same information
+    size_t offset = sizeof(TRACE_HEADER);
+    uint64_t events = 0;
+    while (const CHUNK_HEADER * chunk = ChunkAt(offset))
+    {
+        if (IsCheckpoint(chunk))
+        {
+            INDEX_ENTRY cp;
+            memset(&cp, 0, sizeof(cp));
+            cp._event = events;
+            cp._offset = offset;
+            cp._tid = chunk->_tid;
+            cp._count = chunk->_count;
+            _checkpoints.push_back(cp);
+        }
+        else if (chunk->_tid != CHECKPOINT_TID)
+        {
+            events += chunk->_count;
+        }
+        offset += sizeof(CHUNK_HEADER) + chunk->_bytes;
+    }
+    DropUnreachable();
+}
+
+// A checkpoint other than a keyframe can only be restored through all the
+// ones since its keyframe, so keep only those that have them
+void Replayer::DropUnreachable()
+{
+    std::vector<INDEX_ENTRY> kept;
+    const TRACE_RECORD * last = 0;
+    for (size_t i = 0; i < _checkpoints.size(); i++)
+    {
+        const TRACE_RECORD * rec = CheckpointRecord(_checkpoints[i]);
+        if (rec && (rec->_size == 1 || (last && rec->_value == last->_value + 1)))
+            kept.push_back(_checkpoints[i]);
+        else
+            rec = 0;
+        last = rec;
+    }
+    _checkpoints.swap(kept);
+}
+
+bool Replayer::ReadIndex(const std::string & path)
+{
+    FILE * in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+
+    INDEX_HEADER header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1
+        && strncmp(header._magic, INDEX_MAGIC, sizeof(header._magic)) == 0
+        && header._version == TRACE_VERSION
+        && header._entrySize == sizeof(INDEX_ENTRY);
+
+    INDEX_ENTRY entry;
+    while (ok && fread(&entry, sizeof(entry), 1, in) == 1)
+    {
+        if (entry._tid != CHECKPOINT_TID)
+            continue;
+        // The index may describe a longer file than the one mapped
+        const CHUNK_HEADER * chunk = ChunkAt(entry._offset);
+        if (!chunk)
+            break;
+        if (!IsCheckpoint(chunk) || chunk->_count != entry._count)
+            continue;
+        _checkpoints.push_back(entry);
+    }
+    fclose(in);
+    if (!ok)
+        _checkpoints.clear();
+    return ok;
+}
+
+// Apply the contents of one checkpoint chunk to the rewound state
+void Replayer::LoadCheckpoint(const INDEX_ENTRY & cp)
+{
+    const TRACE_RECORD * rec = reinterpret_cast<const TRACE_RECORD *>(_base + cp._offset + sizeof(CHUNK_HEADER));
+    const TRACE_RECORD * end = rec + cp._count;
+    THREAD_STATE * ts = 0;
+    while (rec < end)
+    {
+        switch (rec->_kind)
+        {
+          case REC_CKPT_THREAD:
+            ts = &Thread(rec->_size);
+            ts->_seen = true;
+            ts->_events = rec->_value;
+            ts->_depth = rec->_ea;
+            rec++;
+            break;
+          case REC_REG:
+            if (ts && rec->_size < NUM_TRACE_GR)
+                ts->_regs[rec->_size] = rec->_value;
+            rec++;
+            break;
+          case REC_VREG:
+            if (ts && rec->_size < NUM_TRACE_VREG && rec->_ea <= TRACE_VREG_BYTES - sizeof(rec->_value))
+                memcpy(ts->_vregs[rec->_size] + rec->_ea, &rec->_value, sizeof(rec->_value));
+            rec++;
+            break;
+          case REC_CKPT_PAGE:
+          {
+            if (end - (rec + 1) < static_cast<ptrdiff_t>(CKPT_PAGE_RECORDS))
+                return;
+            const uint8_t * data = reinterpret_cast<const uint8_t *>(rec + 1);
+            SparseMemory * image = &_state._memory;
+            if (rec->_value)
+            {
+                if (rec->_value > _state._views.size())
+                    _state._views.resize(rec->_value);
+                image = &_state._views[rec->_value - 1];
+            }
+            if (rec->_size == CKPT_PAGE_SIZE && rec->_ea % REPLAY_PAGE_SIZE == 0)
+                image->WritePage(rec->_ea, data, data + CKPT_PAGE_SIZE);
+            rec += 1 + CKPT_PAGE_RECORDS;
+            break;
+          }
+          default:
+            rec++;
+            break;
+        }
+    }
+}
+
+// Rebuild the state at checkpoint n from the keyframe at or before it
+// and the checkpoints since
+void Replayer::RestoreCheckpoint(size_t n)
+{
+    Rewind();
+    size_t k = n;
+    while (k > 0 && CheckpointRecord(_checkpoints[k])->_size != 1)
+        k--;
+    for (; k <= n; k++)
+        LoadCheckpoint(_checkpoints[k]);
+
+    const INDEX_ENTRY & cp = _checkpoints[n];
+
+    _offset = cp._offset + sizeof(CHUNK_HEADER) + ChunkAt(cp._offset)->_bytes;
+    _next = cp._event;
+}
+
+const REPLAY_STATE & Replayer::StateAt(uint64_t index)
+{
+    // Last checkpoint at or before index
+    size_t n = _checkpoints.size();
+    while (n > 0 && _checkpoints[n - 1]._event > index)
+        n--;
+
+    if (n > 0 && (index < _next || _checkpoints[n - 1]._event > _next))
+        RestoreCheckpoint(n - 1);
+    else if (index < _next)
+        Rewind();
+
+    REPLAY_EVENT ev;
+    while (_next < index && NextEvent(&ev))
+        ;
+    return _state;
+}
@@ -0,0 +1,161 @@
+//
+// Streaming replay of a MyPinTool recording. The file is mapped into
+// memory and walked record by record, keeping the register file of every
+// thread and a sparse image of all memory the program stored to.
+// StateAt() starts from the nearest checkpoint instead of the beginning,
+// found through the recording's .idx file or, without one, by walking
+// the chunk headers. Compressed chunks are decoded one at a time.
+//
+//     Replayer r;
+//     if (!r.Open("mypintool.trace")) ...r.Error()...
+//     REPLAY_EVENT ev;
+//     while (r.NextEvent(&ev)) ...r.State()...
+//
+
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "../RecordFormat.h"
+#include "../Codec.h"
+
+#define REPLAY_PAGE_SIZE 4096
+
+// One page of the memory image, with a bit per byte saying whether the
+// recording ever stored to it
+typedef struct MemoryPage
+{
+    uint8_t _data[REPLAY_PAGE_SIZE];
+    uint8_t _known[REPLAY_PAGE_SIZE / 8];
+} MEMORY_PAGE;
+
+class SparseMemory
+{
+  public:
+    void Write(uint64_t addr, const void * data, size_t size);
+
+    // Stores the bytes of the page at addr whose bit in known is set
+    void WritePage(uint64_t addr, const uint8_t * data, const uint8_t * known);
+
+    // Copies what is known of [addr, addr + size) into data, zero-filling
+    // the rest. Returns true if every byte was known
+    bool Read(uint64_t addr, void * data, size_t size) const;
+
+    size_t NumPages() const { return _pages.size(); }
+    void Clear() { _pages.clear(); }
+
+  private:
+    std::unordered_map<uint64_t, MEMORY_PAGE> _pages;
+};
+
+// Architectural state of one thread
+typedef struct ThreadState
+{
+    bool _seen;
+    uint64_t _regs[NUM_TRACE_GR];
+    uint8_t _vregs[NUM_TRACE_VREG][TRACE_VREG_BYTES];
+    uint32_t _depth;            // routine nesting
+    uint64_t _events;           // events of this thread replayed so far
+    uint64_t _stamp;            // last REC_STAMP, 0 before the first
+} THREAD_STATE;
+
+typedef struct ReplayState
+{
+    std::vector<THREAD_STATE> _threads;   // indexed by Pin thread id
+    SparseMemory _memory;
+
+    // With TRACE_LOAD_VALUES, what each thread's own REC_VALUE records
+    // said, indexed by Pin thread id. Loads whose values were left out
+    // read these
+    std::vector<SparseMemory> _views;
+} REPLAY_STATE;
+
+// One record of the recording, in file order. _rec stays valid until the
+// next call into the Replayer
+typedef struct ReplayEvent
+{
+    uint64_t _index;
+    uint32_t _tid;
+    const TRACE_RECORD * _rec;
+} REPLAY_EVENT;
+
+class Replayer
+{
+  public:
+    Replayer();
+    ~Replayer();
+
+    bool Open(const std::string & path);
+    void Close();
+    const std::string & Error() const { return _error; }
+
+    // Applies the next event to State() and describes it in ev. Returns
+    // false at the end of the recording
+    bool NextEvent(REPLAY_EVENT * ev);
+
+    // State after the first 'index' events have been applied, restoring
+    // the closest checkpoint before it. Stops early if the recording is
+    // shorter. The result is the same as a replay from the start
+    const REPLAY_STATE & StateAt(uint64_t index);
+
+    size_t NumCheckpoints() const { return _checkpoints.size(); }
+
+    const REPLAY_STATE & State() const { return _state; }
+
+    // Whether the recording logged the values loads read
+    bool LoadValues() const { return _loadValues; }
+
+    // Bytes of every vector register in THREAD_STATE::_vregs the
+    // recording tracked, 0 if none
+    uint32_t VregBytes() const { return _vregBytes; }
+
+    // Memory as thread tid sees it: its own values over the image of all
+    // threads. Returns true if every byte was known
+    bool ReadAs(uint32_t tid, uint64_t addr, void * data, size_t size) const;
+
+    // Index of the event NextEvent returns next
+    uint64_t Position() const { return _next; }
+
+    void Rewind();
+
+  private:
+    bool NextChunk();
+    const CHUNK_HEADER * ChunkAt(size_t offset) const;
+    void Apply(const REPLAY_EVENT & ev);
+    THREAD_STATE & Thread(uint32_t tid);
+
+    void FindCheckpoints(const std::string & path);
+    bool ReadIndex(const std::string & path);
+    const TRACE_RECORD * CheckpointRecord(const INDEX_ENTRY & cp) const;
+    void DropUnreachable();
+    void RestoreCheckpoint(size_t n);
+    void LoadCheckpoint(const INDEX_ENTRY & cp);
+
+    int _fd;
+    const uint8_t * _base;
+    size_t _size;
+
+    size_t _offset;             // next chunk header
+    const TRACE_RECORD * _cur;  // next record of the current chunk
+    uint32_t _left;             // records left in the current chunk
+    uint32_t _tid;              // thread of the current chunk
+    uint64_t _next;
+    bool _loadValues;
+    uint32_t _vregBytes;
+
+    // Records of the current chunk if it is compressed
+    std::unique_ptr<CODEC_STATE> _codec;
+    std::vector<TRACE_RECORD> _decoded;
+
+    REPLAY_STATE _state;
+    std::string _error;
+
+    std::vector<INDEX_ENTRY> _checkpoints;  // in file order
+};
+
+#endif
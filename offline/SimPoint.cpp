@@ -0,0 +1,261 @@
+//
+// Picks simulation points from the basic block vectors MyPinTool writes
+// with -bbv. Every interval's vector is normalized, reduced to a few
+// dimensions by random projection and clustered with k-means; the
+// interval closest to each cluster's centre represents it, weighted by
+// the share of instructions in the cluster. The output is what
+// MyPinTool -simpoints reads.
+//
+// Build: g++ -O2 -o simpoint SimPoint.cpp
+// Usage: simpoint [-k clusters] [-dim dimensions] [-seed n] [mypintool.bbv]
+//
+// Input lines:  tid interval instructions :block:count :block:count ...
+// Output lines: tid interval weight cluster
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <float.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef struct Interval
+{
+    uint32_t _tid;
+    uint64_t _index;
+    uint64_t _instructions;
+    std::vector<double> _point;     // projected, normalized vector
+} INTERVAL;
+
+// Entry of the projection matrix for a block and dimension, uniform in
+// [-1, 1) and derived from a hash so the matrix is never stored
+static double Projection(uint64_t block, uint32_t dim, uint64_t seed)
+{
+    uint64_t x = (block * 0x9E3779B97F4A7C15ull) ^ (dim * 0xC2B2AE3D27D4EB4Full) ^ seed;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (x >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static bool ReadVectors(std::istream & in, uint32_t dims, uint64_t seed, std::vector<INTERVAL> * intervals)
+{
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        INTERVAL iv;
+        if (!(fields >> iv._tid >> iv._index >> iv._instructions))
+            continue;
+
+        std::vector<std::pair<uint64_t, uint64_t> > counts;
+        uint64_t total = 0;
+        std::string field;
+        while (fields >> field)
+        {
+            uint64_t block, count;
+            if (sscanf(field.c_str(), ":%" SCNu64 ":%" SCNu64, &block, &count) != 2)
+                return false;
+            counts.push_back(std::make_pair(block, count));
+            total += count;
+        }
+        if (total == 0)
+            continue;
+
+        iv._point.assign(dims, 0.0);
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            double share = static_cast<double>(counts[i].second) / total;
+            for (uint32_t d = 0; d < dims; d++)
+                iv._point[d] += share * Projection(counts[i].first, d, seed);
+        }
+        intervals->push_back(iv);
+    }
+    return true;
+}
+
+static double Distance2(const std::vector<double> & a, const std::vector<double> & b)
+{
+    double sum = 0;
+    for (size_t d = 0; d < a.size(); d++)
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    return sum;
+}
+
+// One k-means run seeded k-means++ style. Returns the sum of squared
+// distances, fills in the cluster of every interval
+static double KMeans(const std::vector<INTERVAL> & intervals, uint32_t k, uint64_t seed,
+                     std::vector<uint32_t> * cluster)
+{
+    size_t n = intervals.size();
+    size_t dims = intervals[0]._point.size();
+    srand48(seed);
+
+    std::vector<std::vector<double> > centres;
+    centres.push_back(intervals[lrand48() % n]._point);
+    std::vector<double> nearest(n, DBL_MAX);
+    while (centres.size() < k)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            double d = Distance2(intervals[i]._point, centres.back());
+            if (d < nearest[i])
+                nearest[i] = d;
+            sum += nearest[i];
+        }
+        if (sum == 0)
+            break;
+        double pick = drand48() * sum;
+        size_t i = 0;
+        for (; i + 1 < n && (pick -= nearest[i]) > 0; i++)
+            ;
+        centres.push_back(intervals[i]._point);
+    }
+
+    cluster->assign(n, 0);
+    double sse = 0;
+    for (int iter = 0; iter < 100; iter++)
+    {
+        bool moved = false;
+        sse = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t best = 0;
+            double bestDist = DBL_MAX;
+            for (uint32_t c = 0; c < centres.size(); c++)
+            {
+                double d = Distance2(intervals[i]._point, centres[c]);
+                if (d < bestDist)
+                {
+                    bestDist = d;
+                    best = c;
+                }
+            }
+            moved |= (*cluster)[i] != best;
+            (*cluster)[i] = best;
+            sse += bestDist;
+        }
+        if (!moved && iter > 0)
+            break;
+
+        std::vector<std::vector<double> > sums(centres.size(), std::vector<double>(dims, 0.0));
+        std::vector<size_t> sizes(centres.size(), 0);
+        for (size_t i = 0; i < n; i++)
+        {
+            sizes[(*cluster)[i]]++;
+            for (size_t d = 0; d < dims; d++)
+                sums[(*cluster)[i]][d] += intervals[i]._point[d];
+        }
+        for (size_t c = 0; c < centres.size(); c++)
+        {
+            for (size_t d = 0; sizes[c] && d < dims; d++)
+                centres[c][d] = sums[c][d] / sizes[c];
+        }
+    }
+    return sse;
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t k = 10;
+    uint32_t dims = 15;
+    uint64_t seed = 1;
+    const char * name = "mypintool.bbv";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-k") && i + 1 < argc)
+            k = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-dim") && i + 1 < argc)
+            dims = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], 0, 0);
+        else
+            name = argv[i];
+    }
+    if (k == 0 || dims == 0)
+    {
+        fprintf(stderr, "usage: simpoint [-k clusters] [-dim dimensions] [-seed n] [mypintool.bbv]\n");
+        return 1;
+    }
+
+    std::ifstream in(name);
+    if (!in)
+    {
+        fprintf(stderr, "cannot open %s\n", name);
+        return 1;
+    }
+    std::vector<INTERVAL> intervals;
+    if (!ReadVectors(in, dims, seed, &intervals))
+    {
+        fprintf(stderr, "%s is not a MyPinTool -bbv file\n", name);
+        return 1;
+    }
+    if (intervals.empty())
+    {
+        fprintf(stderr, "%s holds no intervals\n", name);
+        return 1;
+    }
+    if (k > intervals.size())
+        k = intervals.size();
+
+    // k-means only finds a local optimum, keep the best of a few seeds
+    std::vector<uint32_t> cluster;
+    double best = DBL_MAX;
+    for (uint64_t run = 0; run < 5; run++)
+    {
+        std::vector<uint32_t> attempt;
+        double sse = KMeans(intervals, k, seed + run, &attempt);
+        if (sse < best)
+        {
+            best = sse;
+            cluster.swap(attempt);
+        }
+    }
+
+    // Centre of every cluster, then the interval closest to it
+    size_t dimsUsed = intervals[0]._point.size();
+    std::vector<std::vector<double> > centres(k, std::vector<double>(dimsUsed, 0.0));
+    std::vector<uint64_t> sizes(k, 0);
+    std::vector<uint64_t> weight(k, 0);
+    uint64_t total = 0;
+    for (size_t i = 0; i < intervals.size(); i++)
+    {
+        sizes[cluster[i]]++;
+        weight[cluster[i]] += intervals[i]._instructions;
+        total += intervals[i]._instructions;
+        for (size_t d = 0; d < dimsUsed; d++)
+            centres[cluster[i]][d] += intervals[i]._point[d];
+    }
+
+    printf("# %zu intervals, %u clusters\n", intervals.size(), k);
+    printf("# tid interval weight cluster\n");
+    for (uint32_t c = 0; c < k; c++)
+    {
+        if (sizes[c] == 0)
+            continue;
+        for (size_t d = 0; d < dimsUsed; d++)
+            centres[c][d] /= sizes[c];
+
+        size_t pick = 0;
+        double pickDist = DBL_MAX;
+        for (size_t i = 0; i < intervals.size(); i++)
+        {
+            double d = cluster[i] == c ? Distance2(intervals[i]._point, centres[c]) : DBL_MAX;
+            if (d < pickDist)
+            {
+                pickDist = d;
+                pick = i;
+            }
+        }
+        printf("%" PRIu32 " %" PRIu64 " %.6f %" PRIu32 "\n", intervals[pick]._tid, intervals[pick]._index,
+               total ? static_cast<double>(weight[c]) / total : 0.0, c);
+    }
+    return 0;
+}
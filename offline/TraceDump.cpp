@@ -0,0 +1,162 @@
+//
+// Converts a binary recording written by MyPinTool into the text form
+// the tool used to print inline: a banner per routine call, its memory
+// accesses, and the registers it changed.
+//
+// Build: g++ -O2 -o tracedump TraceDump.cpp Replayer.cpp
+// Usage: tracedump [mypintool.trace]
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <vector>
+#include "Replayer.h"
+
+// Register file at the entry of every active routine, per thread, and
+// the vector registers if the recording has them
+typedef std::vector<uint64_t> SNAPSHOT;
+typedef std::vector<uint8_t> VECTOR_SNAPSHOT;
+static std::vector<std::vector<SNAPSHOT> > entryRegs;
+static std::vector<std::vector<VECTOR_SNAPSHOT> > entryVregs;
+
+// Whether the thread's last records were a REC_RTN_ENTER and the entry
+// registers that follow it, which still belong in its snapshot
+static std::vector<bool> inEntry;
+
+// Prints vector register idx, bytes wide, as one hex number
+static void PrintVreg(uint32_t idx, uint32_t bytes, const uint8_t * old, const uint8_t * cur)
+{
+    if (idx >= TRACE_VREG_K0)
+        printf("k%" PRIu32 "\t0x", idx - TRACE_VREG_K0);
+    else
+        printf("%cmm%" PRIu32 "\t0x", bytes == 64 ? 'z' : bytes == 32 ? 'y' : 'x', idx);
+    for (uint32_t i = bytes; i > 0; i--)
+        printf("%02x", old[i - 1]);
+    printf("\t0x");
+    for (uint32_t i = bytes; i > 0; i--)
+        printf("%02x", cur[i - 1]);
+    printf("\n");
+}
+
+int main(int argc, char * argv[])
+{
+    const char * name = argc > 1 ? argv[1] : "mypintool.trace";
+    Replayer replayer;
+    if (!replayer.Open(name))
+    {
+        fprintf(stderr, "%s\n", replayer.Error().c_str());
+        return 1;
+    }
+
+    REPLAY_EVENT ev;
+    uint32_t lastTid = UINT32_MAX;
+    while (replayer.NextEvent(&ev))
+    {
+        const TRACE_RECORD * rec = ev._rec;
+        const THREAD_STATE & ts = replayer.State()._threads[ev._tid];
+        if (ev._tid >= entryRegs.size())
+        {
+            entryRegs.resize(ev._tid + 1);
+            entryVregs.resize(ev._tid + 1);
+            inEntry.resize(ev._tid + 1);
+        }
+        if (ev._tid != lastTid)
+        {
+            printf("# thread %" PRIu32 "\n", ev._tid);
+            lastTid = ev._tid;
+        }
+
+        bool entering = inEntry[ev._tid];
+        inEntry[ev._tid] = false;
+        switch (rec->_kind)
+        {
+          case REC_REG:
+          case REC_VREG:
+            if (entering)
+            {
+                inEntry[ev._tid] = true;
+                if (!entryRegs[ev._tid].empty())
+                    entryRegs[ev._tid].back().assign(ts._regs, ts._regs + NUM_TRACE_GR);
+                if (!entryVregs[ev._tid].empty())
+                    entryVregs[ev._tid].back().assign(&ts._vregs[0][0], &ts._vregs[0][0] + sizeof(ts._vregs));
+            }
+            break;
+          case REC_READ:
+          case REC_WRITE:
+            printf("0x%" PRIx64 ": %c 0x%" PRIx64 " %" PRIu32, rec->_ip,
+                   rec->_kind == REC_WRITE ? 'W' : 'R', rec->_ea, rec->_size);
+            // The values a load read come before it
+            if (rec->_kind == REC_READ && replayer.LoadValues() && rec->_size <= sizeof(uint64_t))
+            {
+                uint64_t value = 0;
+                if (replayer.ReadAs(ev._tid, rec->_ea, &value, rec->_size))
+                    printf(" = 0x%" PRIx64, value);
+            }
+            printf("\n");
+            break;
+          case REC_VALUE:
+            printf("    0x%" PRIx64 " = 0x%" PRIx64 "\n", rec->_ea, rec->_value);
+            break;
+          case REC_STAMP:
+            printf("# stamp %" PRIu64 "\n", rec->_value);
+            break;
+          case REC_GAP:
+            // Frames entered in the gap compare against the state after it
+            printf("# %" PRIu64 " records dropped\n", rec->_value);
+            entryRegs[ev._tid].resize(rec->_ea, SNAPSHOT(ts._regs, ts._regs + NUM_TRACE_GR));
+            if (replayer.VregBytes())
+                entryVregs[ev._tid].resize(rec->_ea, VECTOR_SNAPSHOT(&ts._vregs[0][0], &ts._vregs[0][0] + sizeof(ts._vregs)));
+            break;
+          case REC_SYSCALL:
+            printf("0x%" PRIx64 ": syscall %" PRIu32 " = 0x%" PRIx64 "\n", rec->_ip, rec->_size, rec->_ea);
+            break;
+          case REC_RTN_ENTER:
+            printf("===============================================\n");
+            printf("This is the Routine at Address: \n0x%" PRIx64 "\n", rec->_ip);
+            printf("-----------------------------------------------\n");
+            entryRegs[ev._tid].push_back(SNAPSHOT(ts._regs, ts._regs + NUM_TRACE_GR));
+            if (replayer.VregBytes())
+                entryVregs[ev._tid].push_back(VECTOR_SNAPSHOT(&ts._vregs[0][0], &ts._vregs[0][0] + sizeof(ts._vregs)));
+            inEntry[ev._tid] = true;
+            break;
+          case REC_RTN_EXIT:
+            printf("-----------------------------------------------\n");
+            printf("After Routine\n");
+            printf("Reg\tOld Val\t\t\tNew Val\n");
+            if (!entryRegs[ev._tid].empty())
+            {
+                const SNAPSHOT & old = entryRegs[ev._tid].back();
+                for (int reg = 0; reg < NUM_TRACE_GR; reg++)
+                {
+                    if (old[reg] != ts._regs[reg])
+                        printf("%s\t0x%-16" PRIx64 "\t0x%" PRIx64 "\n", TraceRegNames[reg], old[reg], ts._regs[reg]);
+                }
+                entryRegs[ev._tid].pop_back();
+            }
+            if (!entryVregs[ev._tid].empty())
+            {
+                const VECTOR_SNAPSHOT & old = entryVregs[ev._tid].back();
+                for (uint32_t idx = 0; idx < NUM_TRACE_VREG; idx++)
+                {
+                    uint32_t bytes = idx >= TRACE_VREG_K0 ? sizeof(uint64_t) : replayer.VregBytes();
+                    const uint8_t * before = &old[idx * TRACE_VREG_BYTES];
+                    if (memcmp(before, ts._vregs[idx], bytes) != 0)
+                        PrintVreg(idx, bytes, before, ts._vregs[idx]);
+                }
+                entryVregs[ev._tid].pop_back();
+            }
+            printf("===============================================\n");
+            break;
+          default:
+            break;
+        }
+    }
+
+    if (!replayer.Error().empty())
+    {
+        fprintf(stderr, "%s\n", replayer.Error().c_str());
+        return 1;
+    }
+    return 0;
+}
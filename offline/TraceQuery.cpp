@@ -0,0 +1,381 @@
+//
+// Point queries on a MyPinTool recording: every read or write of an
+// address range, or every call of a routine. The recording and its .idx
+// are mapped into memory and only chunks whose index summary may match
+// are decoded, so a query touches a small part of a large recording.
+//
+// Build: g++ -O2 -o tracequery TraceQuery.cpp
+// Usage: tracequery [-tid n] [-stamps from:to] [mypintool.trace] query
+//
+// Queries: read addr[:size]     reads of any byte of [addr, addr + size)
+//          write addr[:size]    writes, with the values written
+//          access addr[:size]   both
+//          call rtn             entries of the routine at address rtn
+//
+// Output lines: event thread stamp, then the record as tracedump prints it
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../RecordFormat.h"
+#include "../Codec.h"
+#include "../ChunkSummary.h"
+
+enum QueryKind
+{
+    QUERY_READ,
+    QUERY_WRITE,
+    QUERY_ACCESS,
+    QUERY_CALL
+};
+
+typedef struct Query
+{
+    QueryKind _kind;
+    uint64_t _lo;               // byte range, or the routine in _lo
+    uint64_t _hi;
+    uint32_t _tid;              // UINT32_MAX for all threads
+    uint64_t _fromStamp;
+    uint64_t _toStamp;
+} QUERY;
+
+typedef struct MappedFile
+{
+    const uint8_t * _base;
+    size_t _size;
+} MAPPED_FILE;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool Map(const std::string & path, MAPPED_FILE * file)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    file->_base = static_cast<const uint8_t *>(map);
+    file->_size = st.st_size;
+    return true;
+}
+
+// "addr" or "addr:size", in any base strtoull accepts
+static bool ParseRange(const char * arg, uint64_t * lo, uint64_t * hi)
+{
+    char * end;
+    *lo = strtoull(arg, &end, 0);
+    uint64_t size = 1;
+    if (*end == ':')
+        size = strtoull(end + 1, &end, 0);
+    if (*end || size == 0)
+        return false;
+    *hi = *lo + size - 1;
+    return *hi >= *lo;
+}
+
+static bool ParseStamps(const char * arg, uint64_t * from, uint64_t * to)
+{
+    char * end;
+    *from = strtoull(arg, &end, 0);
+    if (*end != ':')
+        return false;
+    *to = strtoull(end + 1, &end, 0);
+    return !*end && *from <= *to;
+}
+
+static bool MayMatch(const QUERY & q, const INDEX_ENTRY & entry)
+{
+    const CHUNK_SUMMARY & s = entry._summary;
+    if (entry._tid == CHECKPOINT_TID || (q._tid != UINT32_MAX && entry._tid != q._tid))
+        return false;
+    if (!SummaryMayOverlap(s, q._fromStamp, q._toStamp))
+        return false;
+    switch (q._kind)
+    {
+      case QUERY_READ:
+        return SummaryHasKind(s, REC_READ) && SummaryMayAccess(s, q._lo, q._hi);
+      case QUERY_WRITE:
+        return SummaryHasKind(s, REC_WRITE) && SummaryMayAccess(s, q._lo, q._hi);
+      case QUERY_ACCESS:
+        return SummaryMayAccess(s, q._lo, q._hi);
+      case QUERY_CALL:
+        return SummaryHasKind(s, REC_RTN_ENTER) && SummaryMayHaveRoutine(s, q._lo);
+    }
+    return false;
+}
+
+static bool Matches(const QUERY & q, const TRACE_RECORD & rec)
+{
+    switch (rec._kind)
+    {
+      case REC_READ:
+      case REC_WRITE:
+        if (q._kind == QUERY_CALL || (q._kind == QUERY_READ && rec._kind != REC_READ)
+            || (q._kind == QUERY_WRITE && rec._kind != REC_WRITE))
+            return false;
+        return rec._ea <= q._hi && rec._ea + (rec._size ? rec._size - 1 : 0) >= q._lo;
+      case REC_RTN_ENTER:
+        return q._kind == QUERY_CALL && rec._ip == q._lo;
+      default:
+        return false;
+    }
+}
+
+enum ChunkStatus
+{
+    CHUNK_OK,
+    CHUNK_TRUNCATED,            // the index describes a longer file
+    CHUNK_MISMATCH,
+    CHUNK_CORRUPT
+};
+
+// The records of the chunk an index entry describes, decoded into
+// 'decoded' unless they are stored raw
+static ChunkStatus ChunkRecords(const MAPPED_FILE & trace, const INDEX_ENTRY & entry, CODEC_STATE * codec,
+                                std::vector<TRACE_RECORD> & decoded, const TRACE_RECORD ** recs)
+{
+    const CHUNK_HEADER * chunk = reinterpret_cast<const CHUNK_HEADER *>(trace._base + entry._offset);
+    if (entry._offset + sizeof(CHUNK_HEADER) > trace._size
+        || chunk->_bytes > trace._size - entry._offset - sizeof(CHUNK_HEADER))
+        return CHUNK_TRUNCATED;
+    if (chunk->_tid != entry._tid || chunk->_count != entry._count)
+        return CHUNK_MISMATCH;
+
+    const uint8_t * payload = reinterpret_cast<const uint8_t *>(chunk + 1);
+    if (chunk->_encoding == CHUNK_RAW && chunk->_bytes == static_cast<size_t>(chunk->_count) * sizeof(TRACE_RECORD))
+    {
+        *recs = reinterpret_cast<const TRACE_RECORD *>(payload);
+        return CHUNK_OK;
+    }
+    decoded.resize(chunk->_count);
+    if (chunk->_encoding != CHUNK_CODEC
+        || !CodecDecode(codec, payload, chunk->_bytes, decoded.data(), chunk->_count))
+        return CHUNK_CORRUPT;
+    *recs = decoded.data();
+    return CHUNK_OK;
+}
+
+// The part of a write's data its REC_VALUE records have yet to give,
+// [_next, _end). They follow the write eight bytes at a time; any other
+// REC_VALUE, such as the value of a load that comes next, ends them
+typedef struct StoreValues
+{
+    uint64_t _next;
+    uint64_t _end;
+} STORE_VALUES;
+
+// Print the values among recs[from, count) that continue the write's,
+// and return where they end
+static uint32_t PrintStoreValues(const TRACE_RECORD * recs, uint32_t from, uint32_t count, STORE_VALUES * store)
+{
+    uint32_t v = from;
+    for (; v < count && store->_next < store->_end; v++)
+    {
+        if (recs[v]._kind != REC_VALUE || recs[v]._ea != store->_next)
+        {
+            store->_next = store->_end;
+            break;
+        }
+        printf("    0x%" PRIx64 " = 0x%" PRIx64 "\n", recs[v]._ea, recs[v]._value);
+        store->_next += recs[v]._size;
+    }
+    return v;
+}
+
+// Print the matches among the records of one chunk. Returns their number,
+// and in 'carried' what the values of the last match, a write, left for
+// the thread's next chunk
+static uint64_t ScanChunk(const QUERY & q, const INDEX_ENTRY & entry, const TRACE_RECORD * recs,
+                          STORE_VALUES * carried)
+{
+    carried->_next = carried->_end = 0;
+    uint64_t matches = 0;
+    uint64_t stamp = entry._summary._firstStamp;
+    for (uint32_t i = 0; i < entry._count; i++)
+    {
+        const TRACE_RECORD & rec = recs[i];
+        if (rec._kind == REC_STAMP)
+            stamp = rec._value;
+        if (!Matches(q, rec) || stamp < q._fromStamp || stamp > q._toStamp)
+            continue;
+
+        matches++;
+        printf("%" PRIu64 " %" PRIu32 " %" PRIu64 " ", entry._event + i, entry._tid, stamp);
+        if (rec._kind == REC_RTN_ENTER)
+        {
+            printf("enter 0x%" PRIx64 "\n", rec._ip);
+            continue;
+        }
+        printf("0x%" PRIx64 ": %c 0x%" PRIx64 " %" PRIu32 "\n", rec._ip,
+               rec._kind == REC_WRITE ? 'W' : 'R', rec._ea, rec._size);
+        if (rec._kind != REC_WRITE)
+            continue;
+        STORE_VALUES store = { rec._ea, rec._ea + rec._size };
+        if (PrintStoreValues(recs, i + 1, entry._count, &store) == entry._count)
+            *carried = store;
+    }
+    return matches;
+}
+
+// Print the values a write at the end of chunk e left to the chunks of
+// its thread after it, which the query need not have decoded
+static ChunkStatus PrintCarriedValues(const MAPPED_FILE & trace, const INDEX_ENTRY * entries, size_t numEntries,
+                                      size_t e, STORE_VALUES store, CODEC_STATE * codec,
+                                      std::vector<TRACE_RECORD> & decoded)
+{
+    uint32_t tid = entries[e]._tid;
+    for (e++; e < numEntries && store._next < store._end; e++)
+    {
+        if (entries[e]._tid != tid)
+            continue;
+        const TRACE_RECORD * recs;
+        ChunkStatus status = ChunkRecords(trace, entries[e], codec, decoded, &recs);
+        if (status != CHUNK_OK)
+            return status;
+        PrintStoreValues(recs, 0, entries[e]._count, &store);
+    }
+    return CHUNK_OK;
+}
+
+static int Usage()
+{
+    fprintf(stderr, "usage: tracequery [-tid n] [-stamps from:to] [mypintool.trace] "
+                    "read|write|access addr[:size] | call rtn\n");
+    return 1;
+}
+
+int main(int argc, char * argv[])
+{
+    QUERY q;
+    memset(&q, 0, sizeof(q));
+    q._tid = UINT32_MAX;
+    q._toStamp = UINT64_MAX;
+    const char * name = "mypintool.trace";
+    const char * kind = 0;
+    const char * operand = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-tid") && i + 1 < argc)
+            q._tid = strtoul(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "-stamps") && i + 1 < argc)
+        {
+            if (!ParseStamps(argv[++i], &q._fromStamp, &q._toStamp))
+                return Usage();
+        }
+        else if (!kind && i + 1 < argc && (!strcmp(argv[i], "read") || !strcmp(argv[i], "write")
+                                         || !strcmp(argv[i], "access") || !strcmp(argv[i], "call")))
+        {
+            kind = argv[i];
+            operand = argv[++i];
+        }
+        else
+            name = argv[i];
+    }
+    if (!kind)
+        return Usage();
+    if (!strcmp(kind, "call"))
+    {
+        char * end;
+        q._kind = QUERY_CALL;
+        q._lo = q._hi = strtoull(operand, &end, 0);
+        if (*end)
+            return Usage();
+    }
+    else
+    {
+        q._kind = !strcmp(kind, "read") ? QUERY_READ : !strcmp(kind, "write") ? QUERY_WRITE : QUERY_ACCESS;
+        if (!ParseRange(operand, &q._lo, &q._hi))
+            return Usage();
+    }
+
+    MAPPED_FILE trace;
+    MAPPED_FILE index;
+    std::string indexName = std::string(name) + ".idx";
+    if (!Map(name, &trace))
+    {
+        fprintf(stderr, "cannot map %s\n", name);
+        return 1;
+    }
+    const TRACE_HEADER * header = reinterpret_cast<const TRACE_HEADER *>(trace._base);
+    if (trace._size < sizeof(TRACE_HEADER) || strncmp(header->_magic, TRACE_MAGIC, sizeof(header->_magic)) != 0
+        || header->_version != TRACE_VERSION || header->_recordSize != sizeof(TRACE_RECORD))
+    {
+        fprintf(stderr, "%s is not a MyPinTool recording of version %d\n", name, TRACE_VERSION);
+        return 1;
+    }
+    if (!Map(indexName, &index))
+    {
+        fprintf(stderr, "cannot map %s, queries need the index\n", indexName.c_str());
+        return 1;
+    }
+    const INDEX_HEADER * indexHeader = reinterpret_cast<const INDEX_HEADER *>(index._base);
+    if (index._size < sizeof(INDEX_HEADER) || strncmp(indexHeader->_magic, INDEX_MAGIC, sizeof(indexHeader->_magic)) != 0
+        || indexHeader->_version != TRACE_VERSION || indexHeader->_entrySize != sizeof(INDEX_ENTRY))
+    {
+        fprintf(stderr, "%s is not a MyPinTool index of version %d\n", indexName.c_str(), TRACE_VERSION);
+        return 1;
+    }
+
+    double start = Now();
+    const INDEX_ENTRY * entries = reinterpret_cast<const INDEX_ENTRY *>(index._base + sizeof(INDEX_HEADER));
+    size_t numEntries = (index._size - sizeof(INDEX_HEADER)) / sizeof(INDEX_ENTRY);
+    std::unique_ptr<CODEC_STATE> codec(new CODEC_STATE);
+    std::vector<TRACE_RECORD> decoded;
+    size_t scanned = 0;
+    uint64_t matches = 0;
+    for (size_t e = 0; e < numEntries; e++)
+    {
+        const INDEX_ENTRY & entry = entries[e];
+        if (!MayMatch(q, entry))
+            continue;
+
+        const TRACE_RECORD * recs;
+        STORE_VALUES carried = { 0, 0 };
+        ChunkStatus status = ChunkRecords(trace, entry, codec.get(), decoded, &recs);
+        if (status == CHUNK_OK)
+        {
+            scanned++;
+            matches += ScanChunk(q, entry, recs, &carried);
+        }
+        if (status == CHUNK_OK && carried._next < carried._end)
+            status = PrintCarriedValues(trace, entries, numEntries, e, carried, codec.get(), decoded);
+
+        // The index may describe a longer file than the recording
+        if (status == CHUNK_TRUNCATED)
+            break;
+        if (status == CHUNK_MISMATCH)
+        {
+            fprintf(stderr, "%s does not match %s\n", indexName.c_str(), name);
+            return 1;
+        }
+        if (status == CHUNK_CORRUPT)
+        {
+            fprintf(stderr, "corrupt chunk in %s\n", name);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%" PRIu64 " matches, %zu of %zu chunks decoded in %.3f s\n",
+            matches, scanned, numEntries, Now() - start);
+    return 0;
+}